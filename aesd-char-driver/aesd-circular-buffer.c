@@ -29,40 +29,64 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    struct aesd_buffer_entry * circ_buff = buffer->entry;
+    uint32_t index = aesd_circular_buffer_find_index_for_fpos(buffer, char_offset, entry_offset_byte_rtn);
 
-    size_t offset_left = char_offset; //We can keep track of how much is left to travel, decrementing for each string iterated.
-    uint8_t cur_offs = buffer->out_offs; //to move through buffer from out_offs->in_offs
+    return aesd_circular_buffer_entry_at(buffer, index);
+}
 
-    //When buffer is full, we have to deal with the first entry before traversing because in_offs==out_offs
-    if (buffer->full){
-        if (offset_left > circ_buff[cur_offs].size-1){
-            offset_left -= circ_buff[cur_offs].size;
-        }
-        else{
-            //We are in the correct entry. Set necessary values.
-            *entry_offset_byte_rtn = offset_left;
-            return &(circ_buff[cur_offs]);
-        }
-        cur_offs = (cur_offs+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+/**
+ * Same as aesd_circular_buffer_find_entry_offset_for_fpos, but returns the index of the entry (0 is the oldest,
+ * see aesd_circular_buffer_entry_at) so callers can continue with the entries which follow it.
+ * @return the index of the entry holding char_offset, or aesd_circular_buffer_count(buffer) if there is none
+ */
+uint32_t aesd_circular_buffer_find_index_for_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn )
+{
+    uint64_t target; //char_offset in the same coordinates as the entry offsets
+    uint32_t low = 0; //the answer is always in [low, high)
+    uint32_t high = aesd_circular_buffer_count(buffer);
+    uint32_t middle;
+
+    if (char_offset >= buffer->total_size)
+        return aesd_circular_buffer_count(buffer);
+    target = buffer->base_offs + char_offset;
+
+    //Entry offsets only grow from the oldest entry to the newest, so binary search for the last entry starting at or before target.
+    //That entry can't be empty: the next one starts after target (or there is none and target < base_offs + total_size).
+    while (high - low > 1){
+        middle = low + (high - low) / 2;
+        if (buffer->entry[aesd_circular_buffer_slot(buffer, middle)].offset <= target)
+            low = middle;
+        else
+            high = middle;
     }
 
-    while(cur_offs != buffer->in_offs){
-        
-        if (offset_left > circ_buff[cur_offs].size-1){
-            offset_left -= circ_buff[cur_offs].size;
-        }
-        else{
-            //We are in the correct entry. Set necessary values.
-            *entry_offset_byte_rtn = offset_left;
-            return &(circ_buff[cur_offs]);
-        }
-
-        cur_offs = (cur_offs+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
+    *entry_offset_byte_rtn = (size_t)(target - buffer->entry[aesd_circular_buffer_slot(buffer, low)].offset);
+    return low;
+}
 
+/**
+ * @param buffer the buffer to search.  Any necessary locking must be performed by caller.
+ * @param timestamp the time to search for, in the units of aesd_buffer_entry timestamp
+ * @return the index (0 is the oldest, see aesd_circular_buffer_entry_at) of the oldest entry added at or
+ * after timestamp, or aesd_circular_buffer_count(buffer) if every entry is older
+ */
+uint32_t aesd_circular_buffer_find_index_for_time(struct aesd_circular_buffer *buffer, uint64_t timestamp)
+{
+    uint32_t low = 0; //the answer is always in [low, high]
+    uint32_t high = aesd_circular_buffer_count(buffer);
+    uint32_t middle;
+
+    //Timestamps never decrease from the oldest entry to the newest, so binary search for the first one not older than timestamp
+    while (low < high){
+        middle = low + (high - low) / 2;
+        if (buffer->entry[aesd_circular_buffer_slot(buffer, middle)].timestamp < timestamp)
+            low = middle + 1;
+        else
+            high = middle;
+    }
 
-    return NULL;
+    return low;
 }
 
 /**
@@ -75,33 +99,85 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 */
 const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-
-    struct aesd_buffer_entry * circ_buff = buffer->entry;
-
-    const char *old_entry_buffer = circ_buff[buffer->in_offs].buffptr;
-
-    circ_buff[buffer->in_offs] = *add_entry;
+    const char *old_entry_buffer = NULL;
 
     if (buffer->full){
-        //Buffer is full, return old value. In full case that old value was next to be consumed so also update out_ffs
-        buffer->in_offs =  (buffer->in_offs+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        buffer->out_offs = (buffer->out_offs+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        return old_entry_buffer;
-    }
-    else{
-        //Standard case when not yet full: simply add at the in_offs and advance, remember to update full var.
-        buffer->in_offs = (buffer->in_offs+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; 
-        if (buffer->in_offs == buffer->out_offs)
-            buffer->full = true;
+        //Buffer is full, return old value. In full case that old value was next to be consumed so also update out_offs
+        old_entry_buffer = aesd_circular_buffer_remove_oldest(buffer);
     }
 
-    return NULL;
+    //Standard case when not yet full: simply add at the in_offs and advance, remember to update full var.
+    buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry[buffer->in_offs].offset = buffer->base_offs + buffer->total_size;
+    buffer->entry[buffer->in_offs].seq = buffer->next_seq++;
+    buffer->in_offs++;
+    if (buffer->in_offs == buffer->max_entries)
+        buffer->in_offs = 0;
+    buffer->in_count++;
+    buffer->total_size += add_entry->size;
+    buffer->total_mem += add_entry->mem_size;
+    if (buffer->in_offs == buffer->out_offs)
+        buffer->full = true;
+
+    return old_entry_buffer;
+}
+
+/**
+* Removes the oldest entry of @param buffer, for callers which evict by something other than entry count.
+* Any necessary locking must be handled by the caller
+* return null if the buffer is empty, otherwise the buffer of the removed entry for freeing by caller
+*/
+const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *oldest;
+    const char *old_entry_buffer;
+
+    if ((buffer->in_offs == buffer->out_offs) && !buffer->full)
+        return NULL;
+
+    //Clear the slot, AESD_CIRCULAR_BUFFER_FOREACH users free every non NULL buffptr it finds
+    oldest = &(buffer->entry[buffer->out_offs]);
+    old_entry_buffer = oldest->buffptr;
+    buffer->total_size -= oldest->size;
+    buffer->total_mem -= oldest->mem_size;
+    buffer->base_offs += oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    oldest->mem_size = 0;
+    buffer->out_offs++;
+    if (buffer->out_offs == buffer->max_entries)
+        buffer->out_offs = 0;
+    buffer->out_count++;
+    buffer->full = false;
+
+    return old_entry_buffer;
 }
 
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* holding up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->inline_entry;
+    buffer->max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct using caller owned storage.
+* @param entries zero filled array of @param max_entries entries, which must outlive the buffer
+* @param max_entries the number of entries to keep before replacing the oldest
+* @return 0 on success, or -1 if max_entries is invalid (buffer is then left untouched)
+*/
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+            uint32_t max_entries)
+{
+    if ((max_entries == 0) || (max_entries > 0x80000000u))
+        return -1;
+
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = entries;
+    buffer->max_entries = max_entries;
+    return 0;
 }
@@ -16,6 +16,7 @@
 #include <stdbool.h>
 #endif
 
+//Number of entries kept by aesd_circular_buffer_init (the default history depth)
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
@@ -28,44 +29,157 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Position of the first byte of this entry in the stream of every byte ever added to the buffer.
+     * Set by aesd_circular_buffer_add_entry, so (offset - buffer->base_offs) is where the entry starts
+     * in the concatenation of the entries currently held.
+     */
+    uint64_t offset;
+    /**
+     * Number of entries added to the buffer before this one. Set by aesd_circular_buffer_add_entry
+     */
+    uint64_t seq;
+    /**
+     * When the entry was added, in units and clock chosen by the caller (the driver uses ns of CLOCK_MONOTONIC).
+     * Copied from the entry passed to aesd_circular_buffer_add_entry, which must be added in non decreasing
+     * timestamp order for aesd_circular_buffer_find_index_for_time to work.
+     */
+    uint64_t timestamp;
+    /**
+     * Bytes of memory the caller charges to this entry, summed in buffer->total_mem. Only bookkeeping:
+     * copied from the entry passed to aesd_circular_buffer_add_entry, and changed with aesd_circular_buffer_set_mem.
+     */
+    size_t mem_size;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations.
+     * Points either at inline_entry or at an array supplied to aesd_circular_buffer_init_capacity,
+     * and always has max_entries elements.
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * The maximum number of entries kept before the oldest one is replaced
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t max_entries;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
-     * The first location in the entry structure to read from
+     * The first location in the entry structure to read from.
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
+    /**
+     * Number of entries ever added. Free running, so in_count - out_count is always the number of
+     * entries held, and callers can keep an entry position which stays valid across wraps of in_offs.
+     */
+    uint32_t in_count;
+    /**
+     * Number of entries ever removed, free running like in_count
+     */
+    uint32_t out_count;
+    /**
+     * Sum of the sizes of all entries held
+     */
+    size_t total_size;
+    /**
+     * Sum of the mem_size of all entries held
+     */
+    size_t total_mem;
+    /**
+     * offset of the oldest entry held (of the next entry added when empty). Advances on eviction,
+     * so base_offs + total_size is always the offset the next entry will get.
+     */
+    uint64_t base_offs;
+    /**
+     * seq the next entry added will get (the number of entries added since init)
+     */
+    uint64_t next_seq;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Storage used by aesd_circular_buffer_init, so that the default sized buffer needs no allocation
+     */
+    struct aesd_buffer_entry inline_entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern uint32_t aesd_circular_buffer_find_index_for_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn );
+
+extern uint32_t aesd_circular_buffer_find_index_for_time(struct aesd_circular_buffer *buffer, uint64_t timestamp);
+
 extern const char * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+            uint32_t max_entries);
+
+/**
+ * @return the number of entries currently held in @param buffer
+ */
+static inline uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->in_count - buffer->out_count;
+}
+
+/**
+ * @return the slot of buffer->entry holding the entry @param index places after the oldest one, for index < max_entries
+ */
+static inline uint32_t aesd_circular_buffer_slot(const struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    uint32_t slot = buffer->out_offs + index;
+
+    return (slot >= buffer->max_entries) ? slot - buffer->max_entries : slot;
+}
+
+/**
+ * @return the entry @param index places after the oldest one (0 is the oldest), or NULL if there are not that many
+ */
+static inline struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    if (index >= aesd_circular_buffer_count(buffer))
+        return NULL;
+    return &(buffer->entry[aesd_circular_buffer_slot(buffer, index)]);
+}
+
+/**
+ * @return the character index of the first byte of @param entry, as used by aesd_circular_buffer_find_entry_offset_for_fpos
+ */
+static inline size_t aesd_circular_buffer_entry_fpos(const struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *entry)
+{
+    return (size_t)(entry->offset - buffer->base_offs);
+}
+
+/**
+ * Changes the memory charged to @param entry, held by @param buffer, to @param mem_size
+ */
+static inline void aesd_circular_buffer_set_mem(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry,
+            size_t mem_size)
+{
+    buffer->total_mem = buffer->total_mem - entry->mem_size + mem_size;
+    entry->mem_size = mem_size;
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +188,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->max_entries; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -0,0 +1,237 @@
+/**
+ * @file aesd-compress.c
+ * @brief Optional LZ4 compression of aesdchar commands
+ *
+ * Commands are committed as written. Once the commands committed since the last block add up to
+ * AESD_BLOCK_MIN_BYTES, a writer seals them into one LZ4 block (see aesd_seal_blocks in main.c) and points
+ * their entries at it. Eviction, srcu reclaim and the logical offsets used by llseek and AESDCHAR_IOCSEEKTO
+ * work exactly as for plain commands: aesd_buffer_entry.size stays the logical size, each entry holds one
+ * reference to the shared block, and the block is freed with the last command evicted from it. Each entry is charged
+ * its share of the block's packed size (aesd_buffer_entry.mem_size), which is what max_bytes and the shrinker limit.
+ * Readers get a decompressed copy of the block from a small per device cache, see aesd_compress_get_plain.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include "aesd-compress.h"
+#if AESD_HAVE_LZ4
+#include <linux/lz4.h>
+#endif
+
+//LZ4 work memory, shared by the devices. Only used with preemption disabled, see aesd_compress_block
+static DEFINE_PER_CPU(void *, aesd_lz4_wrkmem);
+
+/**
+ * Allocates the per cpu LZ4 work memory if @param enable
+ * @return 0 on success, -ENOMEM, or -EOPNOTSUPP if the kernel has no lib/lz4
+ */
+int aesd_compress_module_init(bool enable)
+{
+    if (!enable)
+        return 0;
+
+#if AESD_HAVE_LZ4
+    {
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+            per_cpu(aesd_lz4_wrkmem, cpu) = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+            if (!per_cpu(aesd_lz4_wrkmem, cpu)) {
+                aesd_compress_module_exit();
+                return -ENOMEM;
+            }
+        }
+    }
+    return 0;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
+void aesd_compress_module_exit(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        kvfree(per_cpu(aesd_lz4_wrkmem, cpu));
+        per_cpu(aesd_lz4_wrkmem, cpu) = NULL;
+    }
+}
+
+/**
+ * Sets up the compression state of a device, allocating its sealing buffers only if @param enable
+ * @return 0 on success, -ENOMEM, or -EOPNOTSUPP if the kernel has no lib/lz4
+ */
+int aesd_compress_init(struct aesd_compress *c, bool enable)
+{
+    memset(c, 0, sizeof(*c));
+    mutex_init(&c->seal_lock);
+    spin_lock_init(&c->cache_lock);
+    if (!enable)
+        return 0;
+
+#if AESD_HAVE_LZ4
+    c->plain_buf = kvmalloc(AESD_BLOCK_MAX_BYTES, GFP_KERNEL);
+    c->packed_buf = kvmalloc(LZ4_COMPRESSBOUND(AESD_BLOCK_MAX_BYTES), GFP_KERNEL);
+    if (!c->plain_buf || !c->packed_buf) {
+        aesd_compress_free(c);
+        return -ENOMEM;
+    }
+    c->enabled = true;
+    return 0;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
+/**
+ * Frees the compression state of a device, once no reader can be using its cache
+ */
+void aesd_compress_free(struct aesd_compress *c)
+{
+    int slot;
+
+    for (slot = 0; slot < AESD_PLAIN_CACHE_SLOTS; slot++) {
+        aesd_compress_put_plain(c->cache[slot]);
+        c->cache[slot] = NULL;
+    }
+    kvfree(c->plain_buf);
+    kvfree(c->packed_buf);
+    c->plain_buf = NULL;
+    c->packed_buf = NULL;
+    c->enabled = false;
+}
+
+/**
+ * Compresses the @param plain_size bytes of consecutive commands in c->plain_buf, the first one starting at stream
+ * offset @param first_offset. Caller must hold c->seal_lock.
+ * @return a new AESD_PAYLOAD_LZ4 payload holding the block, with one reference for the caller, or NULL if the
+ * commands don't shrink by at least an eighth or memory is short
+ */
+const char *aesd_compress_block(struct aesd_compress *c, uint64_t first_offset, size_t plain_size)
+{
+#if AESD_HAVE_LZ4
+    struct aesd_block *block;
+    char *payload;
+    int packed_size;
+
+    if (!c->enabled || (plain_size == 0) || (plain_size > AESD_BLOCK_MAX_BYTES))
+        return NULL;
+
+    packed_size = LZ4_compress_default(c->plain_buf, c->packed_buf, plain_size,
+            LZ4_COMPRESSBOUND(AESD_BLOCK_MAX_BYTES), get_cpu_var(aesd_lz4_wrkmem));
+    put_cpu_var(aesd_lz4_wrkmem);
+    if ((packed_size <= 0) || ((size_t)packed_size > plain_size - plain_size / 8))
+        return NULL;
+
+    payload = aesd_payload_alloc(sizeof(struct aesd_block) + packed_size);
+    if (!payload)
+        return NULL;
+    block = (struct aesd_block *)payload;
+    block->first_offset = first_offset;
+    block->plain_size = plain_size;
+    block->packed_size = packed_size;
+    memcpy(block->packed, c->packed_buf, packed_size);
+    aesd_payload_set_flags(payload, AESD_PAYLOAD_LZ4);
+
+    c->blocks++;
+    c->bytes_in += plain_size;
+    c->bytes_out += packed_size;
+    return payload;
+#else
+    return NULL;
+#endif
+}
+
+//@return a new decompressed copy of block, holding one reference, or an ERR_PTR
+static struct aesd_plain *aesd_decompress(const struct aesd_block *block)
+{
+#if AESD_HAVE_LZ4
+    struct aesd_plain *plain;
+
+    plain = kvmalloc(sizeof(struct aesd_plain) + block->plain_size, GFP_KERNEL);
+    if (!plain)
+        return ERR_PTR(-ENOMEM);
+    if (LZ4_decompress_safe(block->packed, plain->data, block->packed_size, block->plain_size) !=
+            (int)block->plain_size) {
+        kvfree(plain);
+        return ERR_PTR(-EIO);
+    }
+    plain->first_offset = block->first_offset;
+    plain->size = block->plain_size;
+    refcount_set(&plain->refs, 1);
+    return plain;
+#else
+    //Nothing is compressed without lib/lz4
+    return ERR_PTR(-EIO);
+#endif
+}
+
+/**
+ * @return the plain bytes of @param entry for a reader: its own buffer, or for a command sealed in a block its part of
+ * a decompressed copy of the block, which *plain is set to and must be released with aesd_compress_put_plain (*plain
+ * is NULL otherwise). An ERR_PTR if the copy can't be made. Caller must be in an srcu read section keeping
+ * entry->buffptr alive.
+ */
+const char *aesd_compress_get_plain(struct aesd_compress *c, const struct aesd_buffer_entry *entry,
+            struct aesd_plain **plain)
+{
+    const struct aesd_block *block;
+    struct aesd_plain *fresh;
+    struct aesd_plain *old;
+    size_t offs_in_block;
+    int slot;
+
+    *plain = NULL;
+    if (!(aesd_payload_flags(entry->buffptr) & AESD_PAYLOAD_LZ4))
+        return entry->buffptr;
+
+    block = (const struct aesd_block *)entry->buffptr;
+    if ((entry->offset < block->first_offset) || (entry->offset - block->first_offset > block->plain_size) ||
+            (entry->size > block->plain_size - (entry->offset - block->first_offset)))
+        return ERR_PTR(-EIO);
+    offs_in_block = entry->offset - block->first_offset;
+
+    spin_lock(&c->cache_lock);
+    for (slot = 0; slot < AESD_PLAIN_CACHE_SLOTS; slot++) {
+        if (c->cache[slot] && (c->cache[slot]->first_offset == block->first_offset)) {
+            refcount_inc(&c->cache[slot]->refs);
+            *plain = c->cache[slot];
+            c->hits++;
+            spin_unlock(&c->cache_lock);
+            return (*plain)->data + offs_in_block;
+        }
+    }
+    c->misses++;
+    spin_unlock(&c->cache_lock);
+
+    fresh = aesd_decompress(block);
+    if (IS_ERR(fresh))
+        return ERR_CAST(fresh);
+
+    //Replace slots round robin, whoever still uses the old copy keeps it alive
+    refcount_inc(&fresh->refs);
+    spin_lock(&c->cache_lock);
+    old = c->cache[c->cache_next];
+    c->cache[c->cache_next] = fresh;
+    c->cache_next = (c->cache_next + 1) % AESD_PLAIN_CACHE_SLOTS;
+    spin_unlock(&c->cache_lock);
+    aesd_compress_put_plain(old);
+
+    *plain = fresh;
+    return fresh->data + offs_in_block;
+}
+
+/**
+ * Releases a copy returned by aesd_compress_get_plain (NULL is ignored)
+ */
+void aesd_compress_put_plain(struct aesd_plain *plain)
+{
+    if (plain && refcount_dec_and_test(&plain->refs))
+        kvfree(plain);
+}
@@ -0,0 +1,82 @@
+/*
+ * aesd-compress.h
+ *
+ *  Optional LZ4 compression of stored aesdchar commands (the compress module parameter)
+ */
+
+#ifndef AESD_COMPRESS_H
+#define AESD_COMPRESS_H
+
+#include <linux/types.h>
+#include <linux/kconfig.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include "aesd-circular-buffer.h"
+#include "aesd-payload.h"
+
+//The kernel's lib/lz4 is only there when something in the kernel configuration selected it
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#define AESD_HAVE_LZ4 1
+#else
+#define AESD_HAVE_LZ4 0
+#endif
+
+//Consecutive commands are sealed into blocks once they add up to this many bytes, so that short lines compress too
+#define AESD_BLOCK_MIN_BYTES (4 * 1024)
+//Largest block. Longer commands are stored as written. Bounds the sealing buffers and the decompressed copies
+#define AESD_BLOCK_MAX_BYTES (16 * 1024)
+//Decompressed blocks kept per device for readers
+#define AESD_PLAIN_CACHE_SLOTS 8
+
+//Data of an AESD_PAYLOAD_LZ4 payload, shared by the entries of every command in the block. A command's bytes start
+//at (entry->offset - first_offset) in the decompressed block, so entries keep their logical offset and size.
+struct aesd_block
+{
+    uint64_t first_offset;  //stream offset (see aesd_buffer_entry.offset) of the first command in the block
+    uint32_t plain_size;    //bytes of the commands it holds
+    uint32_t packed_size;   //bytes in packed
+    char packed[];
+};
+
+//Decompressed copy of a block, shared by the readers of one device
+struct aesd_plain
+{
+    refcount_t refs;        //one for the cache slot holding it, one per reader using it
+    uint64_t first_offset;  //first_offset of the block, which identifies it for the life of the device
+    size_t size;
+    char data[];
+};
+
+//Compression state of one device
+struct aesd_compress
+{
+    bool enabled;
+
+    struct mutex seal_lock;     //one writer seals at a time, protects the fields up to bytes_out
+    uint64_t seal_seq;          //seq of the oldest command which may still be sealed
+    uint64_t seal_offs;         //its stream offset, read without seal_lock to see if sealing is worth trying
+    char *plain_buf;            //commands of the block being sealed, AESD_BLOCK_MAX_BYTES
+    char *packed_buf;           //their compressed form, as large as the LZ4 bound for AESD_BLOCK_MAX_BYTES
+    unsigned long blocks;       //blocks sealed
+    unsigned long bytes_in;     //their size before and after compression
+    unsigned long bytes_out;
+
+    spinlock_t cache_lock;      //protects the cache fields below
+    struct aesd_plain *cache[AESD_PLAIN_CACHE_SLOTS];
+    unsigned int cache_next;    //slot replaced on the next miss
+    unsigned long hits;
+    unsigned long misses;
+};
+
+extern int aesd_compress_module_init(bool enable);
+extern void aesd_compress_module_exit(void);
+extern int aesd_compress_init(struct aesd_compress *c, bool enable);
+extern void aesd_compress_free(struct aesd_compress *c);
+
+extern const char *aesd_compress_block(struct aesd_compress *c, uint64_t first_offset, size_t plain_size);
+extern const char *aesd_compress_get_plain(struct aesd_compress *c, const struct aesd_buffer_entry *entry,
+            struct aesd_plain **plain);
+extern void aesd_compress_put_plain(struct aesd_plain *plain);
+
+#endif /* AESD_COMPRESS_H */
@@ -0,0 +1,274 @@
+/**
+ * @file aesd-payload.c
+ * @brief Allocator for aesdchar command buffers
+ *
+ * Short commands come from driver owned kmem_caches of a few object sizes, medium ones are packed into shared
+ * page chunks (freed once every payload in them is freed), and long ones use kvmalloc so they
+ * never need a high order allocation. This keeps the per command cost low on the write path
+ * and lets large commands succeed on a fragmented system.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/spinlock.h>
+#include <linux/refcount.h>
+#include <linux/atomic.h>
+#include <linux/seq_file.h>
+#include "aesd-payload.h"
+
+//Header at the start of each arena chunk, payloads follow it
+struct aesd_arena_chunk
+{
+    refcount_t refs;    //one per payload in the chunk, plus one while it is the arena's current chunk
+    struct page *page;
+};
+
+//The chunk new arena payloads are carved from
+struct aesd_arena
+{
+    spinlock_t lock;
+    struct aesd_arena_chunk *chunk;
+    size_t used;        //bytes of chunk handed out, header included
+};
+
+struct aesd_payload_stats
+{
+    atomic_long_t allocs[AESD_PAYLOAD_KINDS];
+    atomic_long_t frees[AESD_PAYLOAD_KINDS];
+    atomic_long_t live_bytes[AESD_PAYLOAD_KINDS];   //bytes requested by payloads not freed yet
+    atomic_long_t slab_objects[AESD_SLAB_CLASSES];  //payloads currently held by each kmem_cache
+    atomic_long_t chunks;                           //arena chunks currently allocated
+    atomic_long_t failures;                         //aesd_payload_alloc calls which returned NULL
+};
+
+static struct kmem_cache *payload_caches[AESD_SLAB_CLASSES];
+static const unsigned int slab_class_sizes[AESD_SLAB_CLASSES] = AESD_SLAB_CLASS_SIZES;
+//kmem_cache names must stay valid while the caches exist
+static const char * const slab_class_names[AESD_SLAB_CLASSES] = {
+    "aesdchar_payload_64", "aesdchar_payload_96", "aesdchar_payload_128", "aesdchar_payload_192",
+    "aesdchar_payload_256"
+};
+static struct aesd_arena arena;
+static struct aesd_payload_stats stats;
+
+static const char * const kind_names[AESD_PAYLOAD_KINDS] = { "slab", "arena", "kvmalloc" };
+
+static void aesd_arena_chunk_put(struct aesd_arena_chunk *chunk)
+{
+    if (refcount_dec_and_test(&chunk->refs)) {
+        atomic_long_dec(&stats.chunks);
+        __free_pages(chunk->page, AESD_ARENA_CHUNK_ORDER);
+    }
+}
+
+//Carves total bytes out of the current chunk, starting a new chunk when it is full.
+//Returns NULL if no chunk could be allocated (the caller falls back to kvmalloc)
+static struct aesd_payload *aesd_arena_alloc(size_t total)
+{
+    struct aesd_arena_chunk *fresh = NULL;
+    struct aesd_arena_chunk *retired;
+    struct aesd_payload *payload;
+    struct page *page;
+
+    //Keep every payload header pointer aligned
+    total = ALIGN(total, sizeof(void *));
+
+    for (;;) {
+        spin_lock(&arena.lock);
+        if (arena.chunk && (arena.used + total <= AESD_ARENA_CHUNK_SIZE)) {
+            payload = (struct aesd_payload *)((char *)arena.chunk + arena.used);
+            payload->chunk = arena.chunk;
+            refcount_inc(&arena.chunk->refs);
+            arena.used += total;
+            spin_unlock(&arena.lock);
+            return payload;
+        }
+        if (fresh) {
+            //Current chunk is full: retire it, it is freed along with its last payload
+            retired = arena.chunk;
+            arena.chunk = fresh;
+            arena.used = ALIGN(sizeof(struct aesd_arena_chunk), sizeof(void *));
+            fresh = NULL;
+            spin_unlock(&arena.lock);
+            if (retired)
+                aesd_arena_chunk_put(retired);
+            continue;
+        }
+        spin_unlock(&arena.lock);
+
+        //Don't try hard, a kvmalloc fallback is fine under fragmentation
+        page = alloc_pages(GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY, AESD_ARENA_CHUNK_ORDER);
+        if (!page)
+            return NULL;
+        fresh = page_address(page);
+        fresh->page = page;
+        refcount_set(&fresh->refs, 1);
+        atomic_long_inc(&stats.chunks);
+    }
+}
+
+//@return the smallest slab class holding total bytes, or AESD_SLAB_CLASSES if none does
+static unsigned int aesd_slab_class(size_t total)
+{
+    unsigned int class;
+
+    for (class = 0; class < AESD_SLAB_CLASSES; class++)
+        if (total <= slab_class_sizes[class])
+            break;
+    return class;
+}
+
+/**
+ * @return a buffer of size bytes for a command, to be freed with aesd_payload_free or aesd_payload_free_deferred,
+ * or NULL if out of memory
+ */
+char *aesd_payload_alloc(size_t size)
+{
+    struct aesd_payload *payload = NULL;
+    size_t total = sizeof(struct aesd_payload) + size;
+    unsigned int class = aesd_slab_class(total);
+    u8 kind;
+
+    if (class < AESD_SLAB_CLASSES) {
+        kind = AESD_PAYLOAD_SLAB;
+        payload = kmem_cache_alloc(payload_caches[class], GFP_KERNEL);
+        if (payload) {
+            payload->slab_class = class;
+            atomic_long_inc(&stats.slab_objects[class]);
+        }
+    }
+    else if (total <= AESD_ARENA_MAX_ALLOC) {
+        kind = AESD_PAYLOAD_ARENA;
+        payload = aesd_arena_alloc(total);
+    }
+
+    if (!payload) {
+        kind = AESD_PAYLOAD_KVMALLOC;
+        payload = kvmalloc(total, GFP_KERNEL);
+    }
+    if (!payload) {
+        atomic_long_inc(&stats.failures);
+        return NULL;
+    }
+
+    payload->kind = kind;
+    payload->flags = 0;
+    refcount_set(&payload->refs, 1);
+    payload->size = size;
+    atomic_long_inc(&stats.allocs[kind]);
+    atomic_long_add(size, &stats.live_bytes[kind]);
+    return payload->data;
+}
+
+static void aesd_payload_release(struct aesd_payload *payload)
+{
+    atomic_long_inc(&stats.frees[payload->kind]);
+    atomic_long_sub(payload->size, &stats.live_bytes[payload->kind]);
+
+    switch (payload->kind) {
+        case AESD_PAYLOAD_SLAB:
+            atomic_long_dec(&stats.slab_objects[payload->slab_class]);
+            kmem_cache_free(payload_caches[payload->slab_class], payload);
+            break;
+        case AESD_PAYLOAD_ARENA:
+            aesd_arena_chunk_put(payload->chunk);
+            break;
+        default:
+            kvfree(payload);
+            break;
+    }
+}
+
+/**
+ * Drops a reference to a payload no reader can be using (never published, or device teardown), freeing it with the last
+ */
+void aesd_payload_free(const char *buffptr)
+{
+    struct aesd_payload *payload;
+
+    if (!buffptr)
+        return;
+    payload = container_of(buffptr, struct aesd_payload, data[0]);
+    if (refcount_dec_and_test(&payload->refs))
+        aesd_payload_release(payload);
+}
+
+static void aesd_payload_free_rcu(struct rcu_head *head)
+{
+    aesd_payload_release(container_of(head, struct aesd_payload, rcu));
+}
+
+/**
+ * Drops the reference of an entry which was just evicted from a circular buffer. With the last one the payload is freed
+ * once no reader in srcu can still be copying from it.
+ */
+void aesd_payload_free_deferred(struct srcu_struct *srcu, const char *buffptr)
+{
+    struct aesd_payload *payload;
+
+    if (!buffptr)
+        return;
+    payload = container_of(buffptr, struct aesd_payload, data[0]);
+    if (refcount_dec_and_test(&payload->refs))
+        call_srcu(srcu, &payload->rcu, aesd_payload_free_rcu);
+}
+
+static int aesd_payload_stats_show(struct seq_file *s, void *unused)
+{
+    int kind;
+    int class;
+
+    seq_printf(s, "%-10s %12s %12s %14s\n", "kind", "allocs", "frees", "live_bytes");
+    for (kind = 0; kind < AESD_PAYLOAD_KINDS; kind++)
+        seq_printf(s, "%-10s %12ld %12ld %14ld\n", kind_names[kind], atomic_long_read(&stats.allocs[kind]),
+                atomic_long_read(&stats.frees[kind]), atomic_long_read(&stats.live_bytes[kind]));
+    for (class = 0; class < AESD_SLAB_CLASSES; class++)
+        seq_printf(s, "slab_objects_%u %ld\n", slab_class_sizes[class], atomic_long_read(&stats.slab_objects[class]));
+    seq_printf(s, "arena_chunks %ld\n", atomic_long_read(&stats.chunks));
+    seq_printf(s, "alloc_failures %ld\n", atomic_long_read(&stats.failures));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_payload_stats);
+
+/**
+ * Adds the allocator statistics file (alloc_stats) to the driver's debugfs directory
+ */
+void aesd_payload_debugfs_init(struct dentry *root)
+{
+    debugfs_create_file("alloc_stats", S_IRUGO, root, NULL, &aesd_payload_stats_fops);
+}
+
+int aesd_payload_init(void)
+{
+    unsigned int class;
+
+    spin_lock_init(&arena.lock);
+    //Pointer alignment only: cache line aligning the small classes would round them all back up to 64 bytes or more
+    for (class = 0; class < AESD_SLAB_CLASSES; class++) {
+        payload_caches[class] = kmem_cache_create(slab_class_names[class], slab_class_sizes[class],
+                sizeof(void *), 0, NULL);
+        if (!payload_caches[class]) {
+            while (class--)
+                kmem_cache_destroy(payload_caches[class]);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Called once every payload has been freed (after srcu_barrier on every device)
+ */
+void aesd_payload_exit(void)
+{
+    unsigned int class;
+
+    if (arena.chunk)
+        aesd_arena_chunk_put(arena.chunk);
+    arena.chunk = NULL;
+    for (class = 0; class < AESD_SLAB_CLASSES; class++)
+        kmem_cache_destroy(payload_caches[class]);
+}
@@ -0,0 +1,92 @@
+/*
+ * aesd-payload.h
+ *
+ *  Allocation of the buffers holding aesdchar commands (aesd_buffer_entry.buffptr)
+ */
+
+#ifndef AESD_PAYLOAD_H
+#define AESD_PAYLOAD_H
+
+#include <linux/types.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/debugfs.h>
+#include <linux/refcount.h>
+
+//Where a payload's memory came from, see aesd_payload_alloc
+enum aesd_payload_kind
+{
+    AESD_PAYLOAD_SLAB,      //object of one of the driver's kmem_caches, for short commands
+    AESD_PAYLOAD_ARENA,     //carved out of a shared page chunk, for commands up to AESD_ARENA_MAX_ALLOC
+    AESD_PAYLOAD_KVMALLOC,  //kvmalloc, for long commands (falls back to vmalloc instead of high order pages)
+    AESD_PAYLOAD_KINDS
+};
+
+//Payload kmem_caches, one per object size (header included). Most commands (sensor lines, timestamps) fit the
+//smaller ones, so a 10 byte line costs a 64 byte object instead of one of AESD_SLAB_OBJECT_SIZE
+#define AESD_SLAB_CLASSES 5
+#define AESD_SLAB_CLASS_SIZES { 64, 96, 128, 192, 256 }
+//Largest payload slab object
+#define AESD_SLAB_OBJECT_SIZE 256
+//Arena chunks are 2^AESD_ARENA_CHUNK_ORDER pages
+#define AESD_ARENA_CHUNK_ORDER 2
+#define AESD_ARENA_CHUNK_SIZE (PAGE_SIZE << AESD_ARENA_CHUNK_ORDER)
+//Largest allocation (header included) taken from an arena chunk
+#define AESD_ARENA_MAX_ALLOC PAGE_SIZE
+
+struct aesd_arena_chunk;
+
+//Every buffer which may end up in the circular buffer is allocated with this header in front of it,
+//so that it can be freed after an srcu grace period once it is evicted.
+struct aesd_payload
+{
+    struct rcu_head rcu;
+    struct aesd_arena_chunk *chunk; //AESD_PAYLOAD_ARENA only: chunk holding the payload
+    size_t size;                    //bytes requested from aesd_payload_alloc
+    refcount_t refs;                //one per entry using the payload (a compressed block is shared), see aesd_payload_get
+    u8 kind;                        //enum aesd_payload_kind
+    u8 slab_class;                  //AESD_PAYLOAD_SLAB only: index of the kmem_cache holding the payload
+    u8 flags;                       //AESD_PAYLOAD_* below, 0 from aesd_payload_alloc
+    char data[];
+};
+
+//data holds a struct aesd_block: several consecutive commands LZ4 compressed together, see aesd-compress.c
+#define AESD_PAYLOAD_LZ4 0x01
+
+/**
+ * @return the number of bytes the payload in @param buffptr was allocated with
+ */
+static inline size_t aesd_payload_size(const char *buffptr)
+{
+    return container_of(buffptr, struct aesd_payload, data[0])->size;
+}
+
+static inline u8 aesd_payload_flags(const char *buffptr)
+{
+    return container_of(buffptr, struct aesd_payload, data[0])->flags;
+}
+
+//Only for payloads which aren't published yet
+static inline void aesd_payload_set_flags(char *buffptr, u8 flags)
+{
+    container_of(buffptr, struct aesd_payload, data[0])->flags = flags;
+}
+
+/**
+ * Takes one more reference on the payload in @param buffptr, for one more entry pointing at it.
+ * aesd_payload_free and aesd_payload_free_deferred each drop one.
+ */
+static inline void aesd_payload_get(const char *buffptr)
+{
+    refcount_inc(&container_of(buffptr, struct aesd_payload, data[0])->refs);
+}
+
+extern int aesd_payload_init(void);
+extern void aesd_payload_exit(void);
+extern void aesd_payload_debugfs_init(struct dentry *root);
+
+extern char *aesd_payload_alloc(size_t size);
+extern void aesd_payload_free(const char *buffptr);
+extern void aesd_payload_free_deferred(struct srcu_struct *srcu, const char *buffptr);
+
+#endif /* AESD_PAYLOAD_H */
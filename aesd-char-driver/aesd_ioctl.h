@@ -33,14 +33,144 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Layout of the read only mapping of an aesdchar device (mmap at offset 0, length
+ * header_size + index_size + data_size), available when the module is loaded with mmap_bytes > 0.
+ *
+ * Commands are numbered by a sequence number counting every command ever committed.
+ * Commands tail_seq up to head_seq - 1 can be found in the mapping: command seq is described by
+ * the index entry at index_offset + (seq & (index_slots - 1)) * sizeof(struct aesd_mmap_index), and
+ * its bytes start at data_offset + (offset & (data_size - 1)), wrapping around to data_offset at the end
+ * of the data ring.
+ *
+ * The driver updates the mapping while readers may be looking at it. A reader reads sequence, retries
+ * while it is odd, copies what it needs, and discards the copy if sequence changed meanwhile
+ * (the same protocol as a kernel seqcount).
+ */
+struct aesd_mmap_header {
+    uint32_t magic;         //AESD_MMAP_MAGIC
+    uint32_t version;       //AESD_MMAP_VERSION
+    uint32_t sequence;      //odd while the driver is updating the mapping
+    uint32_t index_slots;   //number of index entries, a power of two
+    uint64_t header_size;   //bytes from the start of the mapping to the index
+    uint64_t index_offset;  //offset of the index in the mapping
+    uint64_t data_offset;   //offset of the data ring in the mapping
+    uint64_t data_size;     //bytes in the data ring, a power of two
+    uint64_t head_seq;      //sequence number the next committed command will get
+    uint64_t tail_seq;      //oldest command still in the mapping (== head_seq when empty)
+};
+
+struct aesd_mmap_index {
+    uint64_t offset;        //stream offset of the first byte of the command
+    uint64_t size;          //bytes in the command
+};
+
+#define AESD_MMAP_MAGIC 0x61657364 // "aesd"
+#define AESD_MMAP_VERSION 1
+
+/**
+ * One stored command, as returned by AESDCHAR_IOCGETINFO
+ */
+struct aesd_entry_info {
+    uint64_t size;          //bytes in the command
+    uint64_t offset;        //file position of its first byte (what llseek and AESDCHAR_IOCSEEKTO use)
+    uint64_t seq;           //number of commands written to the device before this one
+    uint64_t timestamp;     //when it was committed, in ns of CLOCK_MONOTONIC (see clock_gettime)
+};
+
+/**
+ * Argument of AESDCHAR_IOCGETINFO: what the device holds at the start of the call. The table describes those
+ * commands, and stops early if the ones it hasn't reached yet are evicted by writers during the call.
+ */
+struct aesd_info {
+    uint32_t start;         //in: index (0 is the oldest command) of the first command to describe in entries_ptr
+    uint32_t max_entries;   //in: number of elements entries_ptr has room for (0 for the totals only)
+    uint64_t entries_ptr;   //in: user pointer to an array of struct aesd_entry_info
+    uint32_t returned;      //out: number of elements filled in entries_ptr
+    uint32_t entries;       //out: number of commands stored
+    uint64_t total_bytes;   //out: sum of their sizes
+    uint64_t first_seq;     //out: seq of the oldest command (== last_seq + 1 when empty)
+    uint64_t last_seq;      //out: seq of the newest command
+};
+
+/**
+ * Argument of AESDCHAR_IOCREADCMD: copy whole stored commands without touching the file position
+ */
+struct aesd_read_cmd {
+    uint32_t first_cmd;     //in: zero referenced index of the first command to copy (0 is the oldest)
+    uint32_t num_cmds;      //in: number of commands to copy, starting at first_cmd
+    uint64_t buf_ptr;       //in: user pointer to the destination buffer
+    uint64_t buf_len;       //in: size of the destination buffer
+    uint64_t bytes;         //out: bytes copied, or with ENOSPC the size of command first_cmd
+    uint64_t first_seq;     //out: seq (see struct aesd_entry_info) of command first_cmd
+    uint32_t copied_cmds;   //out: number of commands copied, only whole commands are copied
+    uint32_t reserved;
+};
+
+/**
+ * Argument of AESDCHAR_IOCSEEKTIME: the stored commands committed in a time window
+ */
+struct aesd_seektime {
+    uint64_t since;         //in: start of the window, in ns of CLOCK_MONOTONIC (included)
+    uint64_t until;         //in: end of the window (excluded), 0 for no end
+    uint64_t offset;        //out: file position of the first command of the window, the end of data if it is empty
+    uint64_t bytes;         //out: bytes in the commands of the window
+    uint32_t first_cmd;     //out: index (0 is the oldest command) of the first command of the window
+    uint32_t num_cmds;      //out: number of commands in the window
+};
+
+//Longest pattern AESDCHAR_IOCSEARCH accepts
+#define AESD_SEARCH_MAX_PATTERN 256
+
+/**
+ * One command found by AESDCHAR_IOCSEARCH
+ */
+struct aesd_search_match {
+    uint32_t cmd;           //index (0 is the oldest command) of the command
+    uint32_t cmd_offset;    //position of the first occurrence of the pattern within the command
+    uint64_t offset;        //file position of that occurrence
+    uint64_t seq;           //seq of the command (see struct aesd_entry_info), which unlike cmd survives evictions
+};
+
+/**
+ * Argument of AESDCHAR_IOCSEARCH: find the stored commands containing a byte pattern
+ */
+struct aesd_search {
+    uint64_t pattern_ptr;   //in: user pointer to the pattern
+    uint32_t pattern_len;   //in: its length, 1 to AESD_SEARCH_MAX_PATTERN
+    uint32_t start;         //in: index (0 is the oldest command) of the first command to scan
+    uint32_t max_cmds;      //in: number of commands to scan, 0 for all from start
+    uint32_t max_matches;   //in: number of elements matches_ptr has room for
+    uint64_t matches_ptr;   //in: user pointer to an array of struct aesd_search_match
+    uint32_t returned;      //out: number of elements filled in matches_ptr
+    uint32_t scanned;       //out: number of commands scanned, less than asked if matches_ptr filled up.
+                            //     Continue with start + scanned (less the commands evicted meanwhile, see seq)
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Turn follow mode on (non zero) or off (0) for this open file. In follow mode a read at the end of the
+// history waits for the next command instead of returning 0 (or fails with EAGAIN when opened O_NONBLOCK),
+// and the file keeps its place in the stream even as older commands are evicted, like tail -f
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Fill in a struct aesd_info
+#define AESDCHAR_IOCGETINFO _IOWR(AESD_IOC_MAGIC, 3, struct aesd_info)
+// Copy commands [first_cmd, first_cmd + num_cmds), indexed as at the start of the call, as many as fit in the buffer.
+// Stops early at commands evicted during the call. Fails with EINVAL if first_cmd isn't stored, ENOSPC if even
+// command first_cmd doesn't fit
+#define AESDCHAR_IOCREADCMD _IOWR(AESD_IOC_MAGIC, 4, struct aesd_read_cmd)
+// Find the commands committed in [since, until) and move the file position to the first of them.
+// With follow mode on, an empty window leaves the reader waiting for the next command
+#define AESDCHAR_IOCSEEKTIME _IOWR(AESD_IOC_MAGIC, 5, struct aesd_seektime)
+// Scan the commands from start, indexed as at the start of the call, for a pattern without copying them out.
+// Stops early at commands evicted during the call
+#define AESDCHAR_IOCSEARCH _IOWR(AESD_IOC_MAGIC, 6, struct aesd_search)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 6
 
 #endif /* AESD_IOCTL_H */
@@ -8,8 +8,10 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 #include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+#include "aesd-compress.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug (or build with make DEBUG=y)
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -24,6 +26,63 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+//Complete commands of one write reserved together in the commit ring (so they stay contiguous in the stream)
+#define AESD_WRITE_BATCH 8
+
+//Slots of the commit ring, a power of two of at least AESD_WRITE_BATCH
+#define AESD_COMMIT_RING_SLOTS 64
+
+//Smallest allocation for a partial write, so short fragments don't each cause a reallocation
+#define AESD_MIN_PARTIAL_CAPACITY 64
+
+//Entries a read snapshots at a time before copying them out (kept small, the batch lives on the stack)
+#define AESD_READ_BATCH 8
+
+//Upper bound for the mmap_bytes module parameter
+#define AESD_MMAP_MAX_BYTES (1UL << 30)
+
+//Read only copy of the history which userspace can mmap, see struct aesd_mmap_header in aesd_ioctl.h.
+//Only allocated when the module is loaded with mmap_bytes > 0, and only updated with aesd_dev.lock held.
+struct aesd_mirror
+{
+    void *area;                         //vmalloc_user allocation: header page, index, data ring
+    struct aesd_mmap_header *header;    //start of area
+    struct aesd_mmap_index *index;      //header->index_slots entries
+    char *data;                         //header->data_size bytes
+};
+
+//Upper bound for the num_devices module parameter
+#define AESD_MAX_DEVICES 256
+
+//Upper bound for the max_entries module parameter (16M commands, 256MB of entry slots on 64 bit)
+#define AESD_MAX_ENTRIES_LIMIT (1U << 24)
+
+//A command being written, committed to circ_buff once its newline arrives
+struct aesd_partial
+{
+    char *buffptr;      //aesd_payload_alloc buffer, NULL when nothing is allocated
+    size_t size;        //bytes written so far (no newline among them)
+    size_t capacity;    //bytes allocated for buffptr (>= size)
+};
+
+//One slot of the commit ring
+struct aesd_commit_slot
+{
+    atomic64_t state;               //seq of the reservation allowed to fill the slot, that seq + 1 once it is published
+    struct aesd_buffer_entry entry; //the command, valid once published
+};
+
+//Writers reserve slots with a fetch-add on head and fill and publish them without dev->lock. Published slots move
+//to circ_buff in seq order (stream offsets are a running sum of sizes), under dev->lock. A writer only takes the lock
+//when it is free, otherwise it sleeps and the holder commits its slots before unlocking (see aesd_unlock).
+struct aesd_commit_ring
+{
+    atomic64_t head;                //next seq to reserve
+    atomic64_t committed;           //seqs below this one are in circ_buff (written with dev->lock held)
+    wait_queue_head_t commitq;      //writers waiting for an earlier writer to publish
+    struct aesd_commit_slot slot[AESD_COMMIT_RING_SLOTS];
+};
+
 struct aesd_dev
 {
     /**
@@ -31,14 +90,86 @@ struct aesd_dev
      */
 
     struct aesd_circular_buffer circ_buff;  //entire circular buffer of completed writes (already \n)
-    struct aesd_buffer_entry current_entry; //current entry in the circular buffer for write until \n 
-
-    //lock
+    struct aesd_buffer_entry *entries;      //slot array backing circ_buff, sized from the max_entries module parameter
+    //Incomplete command left by files closed before writing its newline. Only continued by the first file opened
+    //for writing after that (echo -n a; echo b), files which were already open keep their writes apart from it.
+    struct aesd_partial orphan;
+    u64 orphan_gen;                         //writer_opens when orphan was last added to (lock)
+    atomic64_t writer_opens;                //number of opens for writing so far
+
+    //lock: serializes writers. Readers never take it, see seq and srcu below.
     struct mutex lock;
 
+    //Readers take a consistent snapshot of circ_buff under this seqcount (written only with lock held)
+    //and retry if a writer changed the buffer meanwhile.
+    seqcount_mutex_t seq;
+
+    //Readers hold an srcu read lock while copying out of an entry, so buffers evicted from circ_buff
+    //are only freed after every reader which might still be using them has finished (see aesd_payload_free_deferred).
+    struct srcu_struct srcu;
+
+    struct aesd_mirror mirror;  //mmap view of circ_buff (area is NULL when disabled)
+
+    //Woken whenever a command is committed, follow mode readers wait here for new data
+    wait_queue_head_t readq;
+
+    //Where writers hand complete commands over for commit
+    struct aesd_commit_ring ring;
+
+    struct aesd_stats __percpu *stats;
+
+    //Block sealing state and decompressed block cache, used when the compress module parameter is set
+    struct aesd_compress compress;
+
+    //Evicts the oldest commands under memory pressure, see aesd_shrink_scan
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    struct shrinker *shrinker;
+#else
+    struct shrinker shrinker;
+#endif
+
     struct cdev cdev;     /* Char device structure      */
 };
 
+//Operations timed by struct aesd_stats
+enum aesd_stats_op
+{
+    AESD_STATS_READ,
+    AESD_STATS_WRITE,
+    AESD_STATS_IOCTL,
+    AESD_STATS_OPS
+};
+
+//Latency histogram bucket i counts operations which took [2^(i-1), 2^i) ns, the last bucket everything longer
+#define AESD_HIST_BUCKETS 40
+
+//Per cpu counters of a device, summed up when read through debugfs (aesdchar/aesdcharN/stats)
+struct aesd_stats
+{
+    u64 ops[AESD_STATS_OPS];
+    u64 bytes[AESD_STATS_OPS];      //bytes read / written
+    u64 commits;                    //commands added to circ_buff
+    u64 evictions;                  //commands dropped from circ_buff
+    u64 shrink_evictions;           //of which dropped under memory pressure
+    u64 lock_wait_ns;               //time writers spent waiting for the dev->lock holder to commit their commands
+    u64 latency[AESD_STATS_OPS][AESD_HIST_BUCKETS];
+};
+
+//State of one open file, kept in filp->private_data
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    bool follow;            //set with AESDCHAR_IOCFOLLOW
+    uint64_t follow_offs;   //in follow mode, stream offset (see aesd_buffer_entry.offset) of the next byte to read
+    //Read cursor: circ_buff position (free running, like in_count) of the last entry this file read from.
+    //Only a hint, checked against the entry's stream offset before use, so evictions can't make it wrong.
+    uint32_t cursor;
+    //Writers of this file stage incomplete commands here without taking the device lock
+    struct mutex wlock;         //serializes writes on this file
+    struct aesd_partial partial;
+    u64 open_gen;               //dev->writer_opens after this file was opened, 0 if not opened for writing
+};
+
 //Reminder on existing structs in aesd-circular-buffer.h:
 
 // struct aesd_buffer_entry
@@ -51,36 +182,53 @@ struct aesd_dev
 //      * Number of bytes stored in buffptr
 //      */
 //     size_t size;
-// };
-
-// struct aesd_circular_buffer
-// {
 //     /**
-//      * An array of pointers to memory allocated for the most recent write operations
+//      * Position of the first byte of this entry in the stream of every byte ever added (set by add_entry)
 //      */
-//     struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+//     uint64_t offset;
 //     /**
-//      * The current location in the entry structure where the next write should
-//      * be stored.
+//      * Number of entries added before this one (set by add_entry)
 //      */
-//     uint8_t in_offs;
+//     uint64_t seq;
 //     /**
-//      * The first location in the entry structure to read from
+//      * When the entry was added, ns of CLOCK_MONOTONIC in the driver (copied from the entry passed to add_entry)
 //      */
-//     uint8_t out_offs;
+//     uint64_t timestamp;
 //     /**
-//      * set to true when the buffer entry structure is full
+//      * Bytes of memory charged to the entry, summed in total_mem. The driver charges a plain command its size,
+//      * and a sealed one its share of the block's packed size (see aesd_seal_install)
 //      */
+//     size_t mem_size;
+// };
+
+// struct aesd_circular_buffer
+// {
+//     struct aesd_buffer_entry *entry;  //max_entries slots, inline or caller supplied (aesd_circular_buffer_init_capacity)
+//     uint32_t max_entries;             //entries kept before the oldest is replaced
+//     uint32_t in_offs;                 //slot the next write goes to
+//     uint32_t out_offs;                //slot of the oldest entry, equal to in_offs when empty or full
+//     uint32_t in_count;                //free running count of entries added
+//     uint32_t out_count;               //free running count of entries removed, in_count - out_count are held
+//     size_t total_size;                //sum of the sizes of all entries held
+//     size_t total_mem;                 //sum of the mem_size of all entries held, what max_bytes and the shrinker limit
+//     uint64_t base_offs;               //offset of the oldest entry held
+//     uint64_t next_seq;                //seq the next entry added will get
 //     bool full;
+//     struct aesd_buffer_entry inline_entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
 // };
 
 
 // extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
 //             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-// extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+// extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+
+// extern const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer);
 
 // extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+// extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+//             uint32_t max_entries);
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
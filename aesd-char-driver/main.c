@@ -17,12 +17,31 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/errno.h> //added by malcolm
+#include <linux/err.h>
 #include <linux/string.h> //added by malcolm
 #include <linux/slab.h>  //added by malcolm
 #include <linux/uaccess.h> //added by malcolm
 #include <linux/fs.h> // file_operations
+#include <linux/moduleparam.h>
+#include <linux/log2.h>
+#include <linux/mm.h> // kvcalloc/kvfree, mmap
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h> // iov_iter
+#include <linux/splice.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/sched/signal.h> // fatal_signal_pending
 //#include <linux/mutex.h> //added by malcolm (maybe unncessary. scull used mutex without it...)
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/shrinker.h>
 #include "aesdchar.h"
+#include "aesd-payload.h"
 #include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
@@ -30,315 +49,1404 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Malcolm McKellips"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+//One device per minor, aesd_minor to aesd_minor + num_devices - 1
+struct aesd_dev *aesd_devices;
+
+//Number of independent devices (/dev/aesdchar0, /dev/aesdchar1, ...), each with its own history and locks
+static unsigned int num_devices = 1;
+module_param(num_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(num_devices, "Number of aesdchar devices (minors) to create (default 1)");
+
+//debugfs directory of the driver (/sys/kernel/debug/aesdchar)
+static struct dentry *aesd_debugfs_root;
+
+//History depth, fixed at load time: insmod aesdchar.ko max_entries=200000
+static unsigned int max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(max_entries, "Number of write commands kept by the device (default 10)");
+
+//Optional memory budget: when non zero the oldest commands are also evicted while the memory they hold exceeds it.
+//Charged with circ_buff.total_mem, so with compress on the budget holds as much more history as the blocks save.
+static unsigned long max_bytes = 0;
+module_param(max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(max_bytes, "Evict the oldest commands once they hold more than this many bytes of memory, compressed size with compress on (0 = no limit)");
+
+//Size of the data ring of the mmap view of the history. 0 disables mmap
+static unsigned long mmap_bytes = 0;
+module_param(mmap_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(mmap_bytes, "Bytes of history readable through mmap, rounded up to a power of two (0 = mmap disabled)");
+
+//Commands kept whatever the memory pressure, the shrinker only evicts those beyond this many
+static unsigned int shrink_floor = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(shrink_floor, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(shrink_floor, "Commands never evicted under memory pressure (default 10, max_entries or more disables the shrinker)");
+
+//Store commands in LZ4 compressed blocks when that saves memory, see aesd-compress.c
+static bool compress;
+module_param(compress, bool, S_IRUGO);
+MODULE_PARM_DESC(compress, "Keep commands in LZ4 compressed blocks when that saves memory (default off, needs a kernel with lib/lz4)");
+
+//Makes sure partial can hold at least needed bytes without moving, growing it geometrically
+//(doubling) so that appending many small partial writes stays linear. Caller must own partial
+//(hold the file's wlock, or dev->lock for dev->orphan).
+//Returns 0 on success or -ENOMEM, in which case partial is unchanged
+static int aesd_partial_reserve(struct aesd_partial *partial, size_t needed)
+{
+    char *new_buffer;
+    size_t new_capacity;
+
+    if (needed <= partial->capacity)
+        return 0;
+
+    new_capacity = max(needed, max(partial->capacity * 2, (size_t)AESD_MIN_PARTIAL_CAPACITY));
+
+    //Payloads come from different allocators depending on their size (see aesd-payload.c), so growing
+    //means a new buffer. A partial command is never visible to readers, so the old one is freed right away.
+    new_buffer = aesd_payload_alloc(new_capacity);
+    if (!new_buffer)
+        return -ENOMEM;
+    if (partial->size)
+        memcpy(new_buffer, partial->buffptr, partial->size);
+    aesd_payload_free(partial->buffptr);
+
+    partial->buffptr = new_buffer;
+    partial->capacity = new_capacity;
+    return 0;
+}
+
+//Allocates the mmap view for dev, sized from mmap_bytes and the circular buffer. Returns 0 or -ENOMEM
+static int aesd_mirror_init(struct aesd_dev *dev)
+{
+    struct aesd_mirror *mirror = &(dev->mirror);
+    unsigned long data_size;
+    unsigned long index_size;
+    uint32_t index_slots = roundup_pow_of_two(dev->circ_buff.max_entries);
+
+    if (mmap_bytes == 0)
+        return 0;
+
+    //At least one index slot per command the device keeps, rounded up to a power of two for the masked index
+    data_size = roundup_pow_of_two(max(min(mmap_bytes, AESD_MMAP_MAX_BYTES), PAGE_SIZE));
+    index_size = PAGE_ALIGN(index_slots * sizeof(struct aesd_mmap_index));
+
+    //vmalloc_user memory is zeroed and can be handed to remap_vmalloc_range
+    mirror->area = vmalloc_user(PAGE_SIZE + index_size + data_size);
+    if (!mirror->area)
+        return -ENOMEM;
+
+    mirror->header = mirror->area;
+    mirror->index = (struct aesd_mmap_index *)((char *)mirror->area + PAGE_SIZE);
+    mirror->data = (char *)mirror->area + PAGE_SIZE + index_size;
+
+    mirror->header->magic = AESD_MMAP_MAGIC;
+    mirror->header->version = AESD_MMAP_VERSION;
+    mirror->header->index_slots = index_slots;
+    mirror->header->header_size = PAGE_SIZE;
+    mirror->header->index_offset = PAGE_SIZE;
+    mirror->header->data_offset = PAGE_SIZE + index_size;
+    mirror->header->data_size = data_size;
+    return 0;
+}
+
+static void aesd_mirror_free(struct aesd_dev *dev)
+{
+    vfree(dev->mirror.area);
+    dev->mirror.area = NULL;
+}
+
+//Copies a command which was just added to circ_buff into the mmap view, dropping whatever it overwrites,
+//and drops commands circ_buff has evicted. Caller must hold dev->lock.
+static void aesd_mirror_commit(struct aesd_dev *dev, const struct aesd_buffer_entry *entry)
+{
+    struct aesd_mirror *mirror = &(dev->mirror);
+    struct aesd_mmap_header *header = mirror->header;
+    uint64_t index_mask;
+    uint64_t data_mask;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t oldest_kept;   //sequence number of the oldest command left in circ_buff
+    uint64_t new_end;       //stream offset just past entry
+    size_t data_pos;
+    size_t first_part;      //bytes of entry copied before the data ring wraps
+
+    if (!mirror->area)
+        return;
+
+    index_mask = header->index_slots - 1;
+    data_mask = header->data_size - 1;
+    head = header->head_seq;
+    tail = header->tail_seq;
+    new_end = entry->offset + entry->size;
+
+    //Mapped readers follow the seqcount protocol on header->sequence
+    WRITE_ONCE(header->sequence, header->sequence + 1);
+    smp_wmb();
+
+    if (entry->size > header->data_size){
+        //Doesn't fit in the data ring at all, it overwrites everything and can't be mapped itself
+        head++;
+        tail = head;
+    }
+    else{
+        //Drop the oldest commands whose index slot or bytes the new command is about to reuse
+        while ((tail != head) && (((head - tail) > index_mask) ||
+                    (mirror->index[tail & index_mask].offset + header->data_size < new_end)))
+            tail++;
+
+        data_pos = entry->offset & data_mask;
+        first_part = min_t(size_t, entry->size, header->data_size - data_pos);
+        memcpy(mirror->data + data_pos, entry->buffptr, first_part);
+        memcpy(mirror->data, entry->buffptr + first_part, entry->size - first_part);
+        mirror->index[head & index_mask].offset = entry->offset;
+        mirror->index[head & index_mask].size = entry->size;
+        head++;
+    }
+
+    //Commands evicted from circ_buff (by count or byte budget) leave the view as well
+    oldest_kept = head - aesd_circular_buffer_count(&(dev->circ_buff));
+    if (tail < oldest_kept)
+        tail = oldest_kept;
+
+    WRITE_ONCE(header->tail_seq, tail);
+    WRITE_ONCE(header->head_seq, head);
+    smp_wmb();
+    WRITE_ONCE(header->sequence, header->sequence + 1);
+}
+
+//Drops the commands circ_buff evicted outside of a commit (see aesd_shrink_scan) from the mmap view.
+//Caller must hold dev->lock.
+static void aesd_mirror_evict(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->mirror.header;
+    uint64_t oldest_kept;
+
+    if (!dev->mirror.area)
+        return;
+
+    oldest_kept = header->head_seq - aesd_circular_buffer_count(&(dev->circ_buff));
+    if (header->tail_seq >= oldest_kept)
+        return;
+
+    WRITE_ONCE(header->sequence, header->sequence + 1);
+    smp_wmb();
+    WRITE_ONCE(header->tail_seq, oldest_kept);
+    smp_wmb();
+    WRITE_ONCE(header->sequence, header->sequence + 1);
+}
+
+//Publishes a complete command in the circular buffer, and if it replaced something, frees the old buffer
+//once readers which may have found it are done with it. Caller must hold dev->lock.
+static void aesd_commit_entry(struct aesd_dev *dev, const struct aesd_buffer_entry *new_entry)
+{
+    struct aesd_buffer_entry stamped = *new_entry;
+    const char *old_buffer;
+
+    //Taken under dev->lock, so timestamps never decrease along the buffer as the time search requires
+    stamped.timestamp = ktime_get_ns();
+
+    write_seqcount_begin(&dev->seq);
+    old_buffer = aesd_circular_buffer_add_entry(&(dev->circ_buff), &stamped);
+    this_cpu_inc(dev->stats->commits);
+    if (old_buffer) {
+        this_cpu_inc(dev->stats->evictions);
+        aesd_payload_free_deferred(&dev->srcu, old_buffer);
+    }
+
+    //Enforce the memory budget, always keeping the newest command even if it alone is over budget
+    while (max_bytes && (dev->circ_buff.total_mem > max_bytes) && (aesd_circular_buffer_count(&(dev->circ_buff)) > 1)) {
+        this_cpu_inc(dev->stats->evictions);
+        aesd_payload_free_deferred(&dev->srcu, aesd_circular_buffer_remove_oldest(&(dev->circ_buff)));
+    }
+
+    aesd_mirror_commit(dev, aesd_circular_buffer_entry_at(&(dev->circ_buff), aesd_circular_buffer_count(&(dev->circ_buff)) - 1));
+    write_seqcount_end(&dev->seq);
+
+    wake_up_interruptible(&dev->readq);
+}
+
+//Moves published slots into circ_buff in seq order, stopping at the first slot still being filled.
+//Caller must hold dev->lock.
+static void aesd_commit_drain(struct aesd_dev *dev)
+{
+    struct aesd_commit_ring *ring = &dev->ring;
+    struct aesd_commit_slot *slot;
+    u64 first = atomic64_read(&ring->committed);
+    u64 seq;
+
+    for (seq = first; ; seq++) {
+        slot = &ring->slot[seq & (AESD_COMMIT_RING_SLOTS - 1)];
+        if ((u64)atomic64_read_acquire(&slot->state) != seq + 1)
+            break;
+        aesd_commit_entry(dev, &slot->entry);
+        //Hand the slot to the reservation one lap later
+        atomic64_set_release(&slot->state, seq + AESD_COMMIT_RING_SLOTS);
+    }
+
+    if (seq != first) {
+        atomic64_set_release(&ring->committed, seq);
+        wake_up_all(&ring->commitq);
+    }
+}
+
+//Whether the oldest slot not committed yet is published
+static bool aesd_commit_pending(struct aesd_commit_ring *ring)
+{
+    u64 seq = atomic64_read(&ring->committed);
+
+    return (u64)atomic64_read_acquire(&ring->slot[seq & (AESD_COMMIT_RING_SLOTS - 1)].state) == seq + 1;
+}
+
+//Releases dev->lock. Every holder releases it this way: writers which find the lock taken leave their published
+//slots to the holder, so it commits them first, and again for any slot published while it was unlocking.
+static void aesd_unlock(struct aesd_dev *dev)
+{
+    do {
+        aesd_commit_drain(dev);
+        mutex_unlock(&dev->lock);
+        //Pairs with the barrier in aesd_commit_wait: either its trylock finds the lock free or we see its slot
+        smp_mb();
+    } while (aesd_commit_pending(&dev->ring) && mutex_trylock(&dev->lock));
+}
+
+static struct aesd_dev *aesd_shrinker_dev(struct shrinker *shrinker)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    return shrinker->private_data;
+#else
+    return container_of(shrinker, struct aesd_dev, shrinker);
+#endif
+}
+
+//Pages of memory the shrinker could free: circ_buff.total_mem (compressed size for sealed commands), less the
+//average share of the shrink_floor commands it keeps. Read without dev->lock, reclaim only needs an estimate.
+static unsigned long aesd_shrink_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    struct aesd_dev *dev = aesd_shrinker_dev(shrinker);
+    uint32_t entries = READ_ONCE(dev->circ_buff.in_count) - READ_ONCE(dev->circ_buff.out_count);
+    unsigned int floor = READ_ONCE(shrink_floor);
+    size_t mem = READ_ONCE(dev->circ_buff.total_mem);
+    unsigned long pages;
+
+    if (entries <= floor)
+        return SHRINK_EMPTY;
+    pages = (mem - mem / entries * floor) >> PAGE_SHIFT;
+    return pages ? pages : SHRINK_EMPTY;
+}
+
+//Evicts the oldest commands until sc->nr_to_scan pages worth of their memory went, keeping shrink_floor. Their
+//buffers are freed after an srcu grace period like any other eviction, and offsets stay consistent since base_offs
+//advances as usual.
+static unsigned long aesd_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    struct aesd_dev *dev = aesd_shrinker_dev(shrinker);
+    unsigned int floor = READ_ONCE(shrink_floor);
+    size_t target = sc->nr_to_scan << PAGE_SHIFT;
+    size_t freed_mem = 0;
+    unsigned long freed = 0;
+
+    //Never wait for dev->lock here: a writer holding it may be the one allocating and reclaiming
+    if (!mutex_trylock(&dev->lock))
+        return SHRINK_STOP;
+
+    write_seqcount_begin(&dev->seq);
+    while ((freed_mem < target) && (aesd_circular_buffer_count(&(dev->circ_buff)) > floor)) {
+        freed_mem += aesd_circular_buffer_entry_at(&(dev->circ_buff), 0)->mem_size;
+        aesd_payload_free_deferred(&dev->srcu, aesd_circular_buffer_remove_oldest(&(dev->circ_buff)));
+        freed++;
+    }
+    aesd_mirror_evict(dev);
+    write_seqcount_end(&dev->seq);
+    aesd_unlock(dev);
+
+    if (!freed)
+        return SHRINK_STOP;
+
+    this_cpu_add(dev->stats->evictions, freed);
+    this_cpu_add(dev->stats->shrink_evictions, freed);
+    PDEBUG("shrinker evicted %lu commands, %zu bytes", freed, freed_mem);
+    return DIV_ROUND_UP(freed_mem, PAGE_SIZE);
+}
+
+static int aesd_shrinker_register(struct aesd_dev *dev, int index)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    dev->shrinker = shrinker_alloc(0, "aesdchar%d", index);
+    if (!dev->shrinker)
+        return -ENOMEM;
+    dev->shrinker->count_objects = aesd_shrink_count;
+    dev->shrinker->scan_objects = aesd_shrink_scan;
+    dev->shrinker->private_data = dev;
+    shrinker_register(dev->shrinker);
+    return 0;
+#else
+    dev->shrinker.count_objects = aesd_shrink_count;
+    dev->shrinker.scan_objects = aesd_shrink_scan;
+    dev->shrinker.seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return register_shrinker(&dev->shrinker, "aesdchar%d", index);
+#else
+    return register_shrinker(&dev->shrinker);
+#endif
+#endif
+}
+
+static void aesd_shrinker_unregister(struct aesd_dev *dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    shrinker_free(dev->shrinker);
+#else
+    unregister_shrinker(&dev->shrinker);
+#endif
+}
+
+//Total number of bytes stored in the circular buffer. Caller must be in a seqcount read section or hold dev->lock.
+static loff_t aesd_total_bytes(struct aesd_dev *dev)
+{
+    return dev->circ_buff.total_size;
+}
+
+//Counts one finished operation in the calling cpu's stats: its latency since start_ns, and bytes transferred if positive
+static void aesd_stats_account(struct aesd_dev *dev, enum aesd_stats_op op, u64 start_ns, ssize_t bytes)
+{
+    u64 elapsed = ktime_get_ns() - start_ns;
+    struct aesd_stats *stats = get_cpu_ptr(dev->stats);
+
+    stats->ops[op]++;
+    if (bytes > 0)
+        stats->bytes[op] += bytes;
+    stats->latency[op][min(fls64(elapsed), AESD_HIST_BUCKETS - 1)]++;
+    put_cpu_ptr(dev->stats);
+}
+
+//Stream offset just past the newest command, i.e. the offset the next committed command will get
+static uint64_t aesd_stream_end(struct aesd_dev *dev)
+{
+    uint64_t stream_end;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        stream_end = dev->circ_buff.base_offs + dev->circ_buff.total_size;
+    } while (read_seqcount_retry(&dev->seq, seq));
+    return stream_end;
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
 
     //Linux device drivers ch3 pg. 58
     struct aesd_dev *dev;
+    struct aesd_file *afile;
     dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
 
     PDEBUG("open");
-    /**
-     * TODO: handle open
-     */
 
-    filp->private_data = dev;
+    afile = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (!afile)
+        return -ENOMEM;
+    afile->dev = dev;
+    mutex_init(&afile->wlock);
+    if (filp->f_mode & FMODE_WRITE)
+        afile->open_gen = atomic64_inc_return(&dev->writer_opens);
+
+    filp->private_data = afile;
 
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *afile = filp->private_data;
+    struct aesd_dev *dev = afile->dev;
+    struct aesd_partial *orphan = &dev->orphan;
+
     PDEBUG("release");
-    /**
-     * TODO: handle release
-     */
+
+    //Hand an incomplete command over to the device, so the next file opened for writing (echo -n a; echo b) completes
+    //it. A file which could have continued the orphan but is closed without writing passes it on the same way.
+    if (afile->partial.size || (afile->open_gen && (afile->open_gen == READ_ONCE(dev->orphan_gen) + 1))) {
+        mutex_lock(&dev->lock);
+        if (!afile->partial.size) {
+            //Only passing the orphan on
+        }
+        else if (!orphan->size) {
+            swap(*orphan, afile->partial);
+        }
+        else if (!aesd_partial_reserve(orphan, orphan->size + afile->partial.size)) {
+            memcpy(orphan->buffptr + orphan->size, afile->partial.buffptr, afile->partial.size);
+            orphan->size += afile->partial.size;
+        }
+        else {
+            PDEBUG("Dropping %zu partial bytes, out of memory", afile->partial.size);
+        }
+        if (orphan->size)
+            dev->orphan_gen = atomic64_read(&dev->writer_opens);
+        aesd_unlock(dev);
+    }
+
+    aesd_payload_free(afile->partial.buffptr);
+    mutex_destroy(&afile->wlock);
+    kfree(afile);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+//Where aesd_do_read copies to: a plain user buffer (read) or an iov_iter (readv, splice, aio)
+struct aesd_read_dest
 {
-        ssize_t retval = 0;
-        struct aesd_dev *dev = filp->private_data;
-        ssize_t offs_in_found = 0; //will be the offset in the found command that fpos points to 
-        struct aesd_buffer_entry *found_entry;
-        ssize_t bytes_to_read = 0;
+    char __user *buf;
+    struct iov_iter *iter;
+};
 
-        PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
-        /**
-         * TODO: handle read
-         */
+static int aesd_copy_out(struct aesd_read_dest *dest, size_t done, const char *src, size_t len)
+{
+    if (dest->iter)
+        return (copy_to_iter(src, len, dest->iter) == len) ? 0 : -EFAULT;
+    return copy_to_user(dest->buf + done, src, len) ? -EFAULT : 0;
+}
 
-        //Reference: scull main.c
-        //return if mutex wait interrupted
-        if (mutex_lock_interruptible(&dev->lock))
-            return -ERESTARTSYS;
+//Finds the index (see aesd_circular_buffer_entry_at) of the entry holding stream offset stream_pos and sets
+//*offs_in_found. Sequential reads continue in the cursor entry or the one after it, which is checked first so they
+//don't need the binary search. Returns aesd_circular_buffer_count if there is no such entry.
+//Caller must be in a seqcount read section or hold dev->lock.
+static uint32_t aesd_find_index(struct aesd_dev *dev, uint64_t stream_pos, uint32_t cursor, size_t *offs_in_found)
+{
+    struct aesd_circular_buffer *buffer = &(dev->circ_buff);
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t index = cursor - buffer->out_count;
+    struct aesd_buffer_entry *entry;
+    int step;
 
-        //Find the entry and offset within that entry corresponding to f_pos
+    for (step = 0; step < 2; step++, index++) {
+        entry = aesd_circular_buffer_entry_at(buffer, index);
+        if (!entry)
+            break;
+        if ((stream_pos >= entry->offset) && (stream_pos - entry->offset < entry->size)) {
+            *offs_in_found = stream_pos - entry->offset;
+            return index;
+        }
+    }
 
-        found_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&(dev->circ_buff), *f_pos, &offs_in_found);
+    if (stream_pos < buffer->base_offs)
+        return count;
+    return aesd_circular_buffer_find_index_for_fpos(buffer, stream_pos - buffer->base_offs, offs_in_found);
+}
 
-        if (found_entry == NULL){
-            retval = 0; 
-            goto read_end;
+//Snapshots up to max entries, starting with the one holding stream offset stream_pos, into batch and sets
+//*offs_in_first to the position of stream_pos in batch[0] and *first to its circ_buff position (like in_count).
+//Returns the number of entries copied, 0 if stream_pos is past the newest command or was evicted already.
+//Caller must be in a seqcount read section or hold dev->lock.
+static unsigned int aesd_snapshot_entries(struct aesd_dev *dev, uint64_t stream_pos, uint32_t cursor,
+                struct aesd_buffer_entry *batch, unsigned int max, size_t *offs_in_first, uint32_t *first)
+{
+    struct aesd_circular_buffer *buffer = &(dev->circ_buff);
+    uint32_t index;
+    unsigned int n;
+
+    index = aesd_find_index(dev, stream_pos, cursor, offs_in_first);
+    *first = buffer->out_count + index;
+    for (n = 0; (n < max) && (index + n < aesd_circular_buffer_count(buffer)); n++)
+        batch[n] = *aesd_circular_buffer_entry_at(buffer, index + n);
+    return n;
+}
+
+//Walks the stored commands by index for the ioctls, AESD_READ_BATCH or so at a time and without dev->lock.
+//Commands never change once stored, so they are followed by seq: index 0 and the totals are fixed by the first batch,
+//commands committed later are left out, and a walk which falls behind eviction just ends early.
+struct aesd_walk
+{
+    uint32_t start;         //index of the first command to walk
+    bool from_seq;          //start at seq instead (or at the oldest command if it was evicted)
+    bool started;           //the fields below are set
+    uint64_t seq;           //seq of the next command to snapshot
+    uint64_t first_seq;     //seq of the command at index 0
+    uint64_t end_seq;       //next_seq when the walk started
+    uint64_t base_offs;     //circ_buff.base_offs when the walk started
+    size_t total_size;      //circ_buff.total_size when the walk started
+};
+
+static void aesd_walk_init(struct aesd_walk *walk, uint32_t start)
+{
+    memset(walk, 0, sizeof(*walk));
+    walk->start = start;
+}
+
+static void aesd_walk_init_seq(struct aesd_walk *walk, uint64_t seq)
+{
+    memset(walk, 0, sizeof(*walk));
+    walk->from_seq = true;
+    walk->seq = seq;
+}
+
+//Snapshots the next up to max commands of walk into batch and returns how many, 0 once the walk is over.
+//Callers using the buffptrs must hold dev->srcu from before the batch until they are done with them.
+static unsigned int aesd_walk_batch(struct aesd_dev *dev, struct aesd_walk *walk,
+                struct aesd_buffer_entry *batch, unsigned int max)
+{
+    struct aesd_circular_buffer *buffer = &(dev->circ_buff);
+    uint64_t oldest_seq;
+    uint64_t index;
+    unsigned int n;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        oldest_seq = buffer->next_seq - aesd_circular_buffer_count(buffer);
+        if (!walk->started) {
+            walk->first_seq = oldest_seq;
+            walk->end_seq = buffer->next_seq;
+            walk->base_offs = buffer->base_offs;
+            walk->total_size = buffer->total_size;
+            if (!walk->from_seq)
+                walk->seq = oldest_seq + walk->start;
+            else if (walk->seq < oldest_seq)
+                walk->seq = oldest_seq;
+        }
+        n = 0;
+        if (walk->seq >= oldest_seq) {
+            index = walk->seq - oldest_seq;
+            for (; (n < max) && (walk->seq + n < walk->end_seq); n++)
+                batch[n] = *aesd_circular_buffer_entry_at(buffer, index + n);
         }
+    } while (read_seqcount_retry(&dev->seq, seq));
 
-        //Read from fpos to end of entry and update fpos
-        bytes_to_read = ((found_entry->size) - offs_in_found);
-        if (count < bytes_to_read)
-            bytes_to_read = count;
+    walk->started = true;
+    walk->seq += n;
+    return n;
+}
 
-        if ( copy_to_user(buf, ((found_entry->buffptr) + offs_in_found), bytes_to_read) ){
-            retval = -EFAULT;
-            goto read_end;
+//@return the index walk reports for a command it snapshot
+static inline uint32_t aesd_walk_index(const struct aesd_walk *walk, const struct aesd_buffer_entry *entry)
+{
+    return entry->seq - walk->first_seq;
+}
+
+//Copies up to count bytes of history starting at the file position into dest, across as many commands as needed.
+//Returns the number of bytes copied, 0 at the end of the history, or a negative error.
+//nonblock: in follow mode, fail with -EAGAIN instead of waiting for the next command
+static ssize_t aesd_do_read(struct file *filp, struct aesd_read_dest *dest, size_t count, loff_t *f_pos, bool nonblock)
+{
+        ssize_t retval = 0;
+        struct aesd_file *afile = filp->private_data;
+        struct aesd_dev *dev = afile->dev;
+        struct aesd_buffer_entry batch[AESD_READ_BATCH]; //entries copied inside a seqcount read section
+        struct aesd_plain *plain;
+        const char *data;
+        unsigned int batch_len = 0;
+        unsigned int i;
+        uint32_t batch_first = 0; //circ_buff position of batch[0]
+        uint32_t cursor = READ_ONCE(afile->cursor);
+        size_t offs_in_found = 0; //will be the offset in the first command of the batch that we read from
+        uint64_t base_offs = 0; //circ_buff.base_offs when the read started
+        uint64_t start_stream = 0; //stream offset the read started at
+        uint64_t stream_pos; //stream offset of the next byte to copy
+        size_t copied = 0;
+        size_t bytes_to_read;
+        unsigned int seq;
+        int srcu_idx;
+
+        PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+
+        if (count == 0)
+            return 0;
+
+        for (;;) {
+            //No mutex here: readers only hold off the freeing of evicted buffers (srcu)
+            //and retry the lookup if a writer modified the circular buffer under them (seqcount).
+            srcu_idx = srcu_read_lock(&dev->srcu);
+
+            //Find the entry and offset within that entry corresponding to f_pos
+            do {
+                seq = read_seqcount_begin(&dev->seq);
+                base_offs = dev->circ_buff.base_offs;
+                if (afile->follow)
+                    //Followers keep their place in the stream, commands evicted since the last read are skipped
+                    start_stream = max(afile->follow_offs, base_offs);
+                else
+                    start_stream = base_offs + *f_pos;
+                batch_len = aesd_snapshot_entries(dev, start_stream, cursor, batch, AESD_READ_BATCH,
+                        &offs_in_found, &batch_first);
+            } while (read_seqcount_retry(&dev->seq, seq));
+
+            if (batch_len)
+                break;
+
+            srcu_read_unlock(&dev->srcu, srcu_idx);
+
+            //End of the history: plain reads see end of file, followers wait for the next command
+            if (!afile->follow)
+                return 0;
+            if (nonblock)
+                return -EAGAIN;
+            if (wait_event_interruptible(dev->readq, aesd_stream_end(dev) > afile->follow_offs))
+                return -ERESTARTSYS;
         }
 
-        *f_pos +=  bytes_to_read;
-        retval = bytes_to_read;
+        //Copy command after command until the caller's buffer is full or the history ends.
+        //Snapshot buffptrs stay valid until srcu_read_unlock, even if their entries are evicted meanwhile.
+        stream_pos = start_stream;
+        while (batch_len) {
+            for (i = 0; (i < batch_len) && (copied < count); i++) {
+                bytes_to_read = min(batch[i].size - offs_in_found, count - copied);
+                data = aesd_compress_get_plain(&dev->compress, &batch[i], &plain);
+                if (IS_ERR(data)) {
+                    retval = PTR_ERR(data);
+                    goto read_end;
+                }
+                retval = aesd_copy_out(dest, copied, data + offs_in_found, bytes_to_read);
+                aesd_compress_put_plain(plain);
+                if (retval)
+                    goto read_end;
+                copied += bytes_to_read;
+                stream_pos += bytes_to_read;
+                offs_in_found = 0;
+                cursor = batch_first + i;
+            }
+            if (copied == count)
+                break;
+
+            //Continue with the next commands. If the rest was evicted while we copied, stop here with a short read.
+            do {
+                seq = read_seqcount_begin(&dev->seq);
+                batch_len = aesd_snapshot_entries(dev, stream_pos, cursor, batch, AESD_READ_BATCH,
+                        &offs_in_found, &batch_first);
+            } while (read_seqcount_retry(&dev->seq, seq));
+        }
 
     read_end:
-        //unlock lock here...
-        mutex_unlock(&dev->lock);
+        srcu_read_unlock(&dev->srcu, srcu_idx);
+
+        //A fault after some bytes were copied is reported as a short read
+        if (copied) {
+            WRITE_ONCE(afile->cursor, cursor);
+            *f_pos = (start_stream - base_offs) + copied;
+            if (afile->follow)
+                afile->follow_offs = start_stream + copied;
+            retval = copied;
+        }
         //PDEBUG("read returning with %zu bytes read", retval);
         //PDEBUG("filepos after read: %lld",*f_pos);
         return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
+//aesd_do_read, counted in the device stats
+static ssize_t aesd_read_common(struct file *filp, struct aesd_read_dest *dest, size_t count, loff_t *f_pos, bool nonblock)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    u64 start_ns = ktime_get_ns();
+    ssize_t retval;
+
+    retval = aesd_do_read(filp, dest, count, f_pos, nonblock);
+    aesd_stats_account(dev, AESD_STATS_READ, start_ns, retval);
+    return retval;
+}
+
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    struct aesd_read_dest dest = { .buf = buf, .iter = NULL };
+
+    return aesd_read_common(filp, &dest, count, f_pos, filp->f_flags & O_NONBLOCK);
+}
+
+//readv, aio and (through copy_splice_read) splice to pipes and sockets
+static ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_read_dest dest = { .buf = NULL, .iter = to };
+    struct file *filp = iocb->ki_filp;
+
+    return aesd_read_common(filp, &dest, iov_iter_count(to), &iocb->ki_pos,
+            (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT));
+}
+
+//Reports EPOLLIN while there is history past the file's position (past follow_offs in follow mode).
+//Writes never wait, so the device is always writable.
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *afile = filp->private_data;
+    struct aesd_dev *dev = afile->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    unsigned int seq;
+    bool readable;
+
+    poll_wait(filp, &dev->readq, wait);
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        if (afile->follow)
+            readable = (dev->circ_buff.base_offs + dev->circ_buff.total_size) > afile->follow_offs;
+        else
+            readable = filp->f_pos < aesd_total_bytes(dev);
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    if (readable)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+//Continues the command a closed file left incomplete (dev->orphan) in this file, if it has none of its own and is the
+//first file opened for writing since. Caller must hold afile->wlock.
+static void aesd_adopt_orphan(struct aesd_file *afile)
+{
+    struct aesd_dev *dev = afile->dev;
+
+    //Unlocked peek, a release racing with this write may as well have come after it
+    if (!READ_ONCE(dev->orphan.size) || afile->partial.size || (afile->open_gen != READ_ONCE(dev->orphan_gen) + 1))
+        return;
+
+    mutex_lock(&dev->lock);
+    if (dev->orphan.size && (afile->open_gen == dev->orphan_gen + 1)) {
+        swap(afile->partial, dev->orphan);
+        aesd_payload_free(dev->orphan.buffptr);
+        memset(&dev->orphan, 0, sizeof(dev->orphan));
+    }
+    aesd_unlock(dev);
+}
+
+static void aesd_commit_ring_init(struct aesd_commit_ring *ring)
+{
+    unsigned int i;
+
+    atomic64_set(&ring->head, 0);
+    atomic64_set(&ring->committed, 0);
+    init_waitqueue_head(&ring->commitq);
+    for (i = 0; i < AESD_COMMIT_RING_SLOTS; i++)
+        atomic64_set(&ring->slot[i].state, i);
+}
+
+//Waits until *var reaches target: a slot state, for a writer waiting for its slot to be free, or ring->committed,
+//for a writer waiting for its commands to be in circ_buff. The writer commits what is published itself if it gets
+//dev->lock without waiting, otherwise the holder commits it (see aesd_unlock). If that isn't enough an earlier
+//writer hasn't published yet: sleep until it has (aesd_commit_batch wakes commitq) and drain again, or until
+//whoever drained moved *var far enough.
+static void aesd_commit_wait(struct aesd_dev *dev, atomic64_t *var, u64 target)
+{
+    struct aesd_commit_ring *ring = &dev->ring;
+    u64 wait_start_ns;
+
+    while ((u64)atomic64_read_acquire(var) < target) {
+        //Order our publish before the trylock, pairs with the barrier in aesd_unlock
+        smp_mb();
+        if (mutex_trylock(&dev->lock)) {
+            aesd_unlock(dev);
+            if ((u64)atomic64_read_acquire(var) >= target)
+                break;
+        }
+
+        //Not interruptible: the commands were accepted already, and the wait only ever is for earlier writers.
+        //A published slot is only worth waking up for while nobody holds dev->lock, the holder drains it otherwise.
+        wait_start_ns = ktime_get_ns();
+        wait_event(ring->commitq, ((u64)atomic64_read_acquire(var) >= target) ||
+                (aesd_commit_pending(ring) && !mutex_is_locked(&dev->lock)));
+        this_cpu_add(dev->stats->lock_wait_ns, ktime_get_ns() - wait_start_ns);
+    }
+}
+
+//Commits complete commands, contiguous in the stream, and returns once readers can see them.
+//Only a fetch-add is shared with other writers until the commands are published, see struct aesd_commit_ring.
+static void aesd_commit_batch(struct aesd_dev *dev, const struct aesd_buffer_entry *batch, unsigned int batch_len)
+{
+    struct aesd_commit_ring *ring = &dev->ring;
+    struct aesd_commit_slot *slot;
+    u64 first = atomic64_fetch_add(batch_len, &ring->head);
+    unsigned int i;
+
+    for (i = 0; i < batch_len; i++) {
+        slot = &ring->slot[(first + i) & (AESD_COMMIT_RING_SLOTS - 1)];
+        aesd_commit_wait(dev, &slot->state, first + i);
+        slot->entry = batch[i];
+        atomic64_set_release(&slot->state, first + i + 1);
+        //Later writers may be asleep waiting for this slot, see aesd_commit_wait. wq_has_sleeper orders the
+        //publish before checking for them
+        if (wq_has_sleeper(&ring->commitq))
+            wake_up_all(&ring->commitq);
+    }
+
+    aesd_commit_wait(dev, &ring->committed, first + batch_len);
+}
+
+//Points the entries of commands [first_seq, first_seq + num) still held at block, dropping their own buffers
+static void aesd_seal_install(struct aesd_dev *dev, const char *block, uint64_t first_seq, uint32_t num)
+{
+    const struct aesd_block *packed = (const struct aesd_block *)block;
+    struct aesd_circular_buffer *buffer = &(dev->circ_buff);
+    struct aesd_buffer_entry *entry;
+    uint64_t oldest_seq;
+    uint64_t seq;
+
+    mutex_lock(&dev->lock);
+    write_seqcount_begin(&dev->seq);
+    oldest_seq = buffer->next_seq - aesd_circular_buffer_count(buffer);
+    for (seq = max(first_seq, oldest_seq); seq < first_seq + num; seq++) {
+        entry = aesd_circular_buffer_entry_at(buffer, seq - oldest_seq);
+        aesd_payload_get(block);
+        aesd_payload_free_deferred(&dev->srcu, entry->buffptr);
+        entry->buffptr = block;
+        //Each command is charged its share of the block, so max_bytes and the shrinker see what the block saved.
+        //Both sizes are at most AESD_BLOCK_MAX_BYTES, the product can't overflow
+        aesd_circular_buffer_set_mem(buffer, entry, DIV_ROUND_UP(entry->size * packed->packed_size, packed->plain_size));
+    }
+    write_seqcount_end(&dev->seq);
+    aesd_unlock(dev);
+}
+
+//Seals the commands committed since the last block into LZ4 blocks of AESD_BLOCK_MIN_BYTES to AESD_BLOCK_MAX_BYTES
+//(see aesd-compress.c). Called by writers once their commands are committed, since only then is it known which
+//commands are consecutive. The commands are gathered (walked like the ioctls do) and compressed without dev->lock,
+//which is only taken to point the entries still held at the block. Commands evicted meanwhile are just left out.
+static void aesd_seal_blocks(struct aesd_dev *dev)
+{
+    struct aesd_compress *c = &dev->compress;
+    struct aesd_buffer_entry batch[AESD_READ_BATCH];
+    struct aesd_walk walk;
+    const char *block;
+    uint64_t first_seq;
+    uint64_t first_offset;
+    size_t plain_size;
+    uint32_t num;
+    unsigned int batch_len;
+    unsigned int i;
+    bool full;          //the next command doesn't fit the block
+    int srcu_idx;
+
+    if (!c->enabled || (aesd_stream_end(dev) - READ_ONCE(c->seal_offs) < AESD_BLOCK_MIN_BYTES))
+        return;
+    //Whoever is sealing already may as well take our commands too, or the next writer will
+    if (!mutex_trylock(&c->seal_lock))
+        return;
+
+    srcu_idx = srcu_read_lock(&dev->srcu);
+    for (;;) {
+        aesd_walk_init_seq(&walk, c->seal_seq);
+        plain_size = 0;
+        num = 0;
+        full = false;
+        first_seq = 0;
+        first_offset = 0;
+        while (!full && (batch_len = aesd_walk_batch(dev, &walk, batch, AESD_READ_BATCH))) {
+            for (i = 0; i < batch_len; i++) {
+                if (batch[i].size > AESD_BLOCK_MAX_BYTES - plain_size) {
+                    full = true;
+                    break;
+                }
+                if (!num) {
+                    first_seq = batch[i].seq;
+                    first_offset = batch[i].offset;
+                }
+                //Not sealed yet, so the buffer still holds the plain command
+                memcpy(c->plain_buf + plain_size, batch[i].buffptr, batch[i].size);
+                plain_size += batch[i].size;
+                num++;
+            }
+        }
+
+        if (full && !num) {
+            //Too long for a block, it stays as written
+            c->seal_seq = batch[i].seq + 1;
+            WRITE_ONCE(c->seal_offs, batch[i].offset + batch[i].size);
+            continue;
+        }
+        //Wait for more commands unless the block is as full as it gets
+        if (!full && (plain_size < AESD_BLOCK_MIN_BYTES))
+            break;
+
+        //Commands which don't compress well stay as written too
+        block = aesd_compress_block(c, first_offset, plain_size);
+        if (block) {
+            aesd_seal_install(dev, block, first_seq, num);
+            aesd_payload_free(block);
+        }
+        c->seal_seq = first_seq + num;
+        WRITE_ONCE(c->seal_offs, first_offset + plain_size);
+        cond_resched();
+    }
+    srcu_read_unlock(&dev->srcu, srcu_idx);
+
+    mutex_unlock(&c->seal_lock);
+}
+
+static ssize_t aesd_do_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
         ssize_t retval = -ENOMEM;
-        struct aesd_dev *dev = filp->private_data;
-        char * new_write;
-        const char * old_buffer;
-        char * full_buffer; //will hold old_buffer + new_write when \n received.
-        char * newl_ptr; //Will be a pointer to the newline char in a new write if found
-        ssize_t len_cmd; //Length up to and including the newline if a newline recvd
-        ssize_t full_buffer_size; //size of full buffer when we are about to write it to circular buffer
-        ssize_t i;
+        struct aesd_file *afile = filp->private_data;
+        struct aesd_dev *dev = afile->dev;
+        struct aesd_partial *partial = &afile->partial;
+        struct aesd_buffer_entry batch[AESD_WRITE_BATCH]; //complete commands found in this write, not committed yet
+        unsigned int batch_len = 0;
+        char * staging; //partial buffer: old saved chars followed by this write
+        char * newl_ptr; //Will be a pointer to each newline char in the new write
+        char * cmd_buffer; //buffer for a command which doesn't span the whole staging buffer
+        size_t old_size; //bytes saved in partial by previous writes (known to contain no newline)
+        size_t staged; //old_size + count
+        size_t cmd_start = 0; //offset in staging of the first byte not yet committed
+        size_t cmd_end; //offset in staging just past a newline
 
         PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
-        /**
-         * TODO: handle write
-         */
 
         //Reference: scull main.c
-        //return if mutex wait interrupted
-        if (mutex_lock_interruptible(&dev->lock))
+        //Partial commands are staged per file, so this only waits for other writers of the same file.
+        //Complete commands are handed over through the commit ring (aesd_commit_batch).
+        if (mutex_lock_interruptible(&afile->wlock))
             return -ERESTARTSYS;
 
-        new_write = (char *)kmalloc(count, GFP_KERNEL);
-        if (!new_write){
-            PDEBUG("Error in kmalloc of new write!");
+        aesd_adopt_orphan(afile);
+
+        //Append in place: make room at the end of partial and copy the user data straight into it.
+        //Capacity grows geometrically, so a command streamed in many small writes is copied O(1) times per byte.
+        old_size = partial->size;
+        staged = old_size + count;
+        if (aesd_partial_reserve(partial, staged)){
+            PDEBUG("Error growing partial command!");
             retval = -ENOMEM;
-            kfree(new_write);
             goto write_end;
         }
+        staging = partial->buffptr;
 
-
-        if (copy_from_user(new_write, buf, count)){
+        if (copy_from_user(staging + old_size, buf, count)){
             PDEBUG("Error copying from user!");
             retval = -EFAULT;
-            kfree(new_write);
             goto write_end;
         }
 
-        //This is where the more complicated kmalloc/write logic will go...
-        //For now, simple implementation assuming that every write is a complete write with a \n at the end.
-
-        //Free old current entry and set current entry to our new current entry
-        //kfree(dev->current_entry.buffptr);
-        //NO!!! Don't free old current entry. it could have been moved into circular buffer.
-
-        //will return pointer to where the newline char is in new_write
-        newl_ptr = NULL;
-        //newl_ptr = strchr(new_write, '\n');
-        for (i = 0 ; i < count; i++){
-            if (new_write[i] == '\n')
-                newl_ptr = new_write+i;
-        }
-
-        if(newl_ptr){
-            //PDEBUG("cmd recvd: %s", new_write);
-            /*
-            for (i = 0; i < count; i++){
-                if (new_write[i] == '\n')
-                    PDEBUG("newline in command is located at %ld", i);
+        //Build one circular buffer entry per newline, in a single pass over the new bytes, and commit them in batches
+        while ((newl_ptr = memchr(staging + max(cmd_start, old_size), '\n', staged - max(cmd_start, old_size))) != NULL){
+            cmd_end = (newl_ptr - staging) + 1;
+
+            if ((cmd_start == 0) && (cmd_end == staged)){
+                //The command is everything staged (the usual single command write), hand over the buffer itself
+                batch[batch_len].buffptr = staging;
+                batch[batch_len].size = staged;
+                batch[batch_len].mem_size = staged;
+                partial->buffptr = NULL;
+                partial->capacity = 0;
             }
-            */
-            //new line recvd, we must write to buffer all values upto and including newline
-            len_cmd = (ssize_t)(newl_ptr - new_write); 
-            len_cmd += 1; // +1 because 0 indexed (might need another +1 for null terminator. hopefully read takes care of this for us)
-
-            full_buffer_size = len_cmd + dev->current_entry.size; //the new full buffer to save in circ buff contains new write until newline plus old saved chars
-
-            full_buffer = (char *)kmalloc( full_buffer_size, GFP_KERNEL);
-
-            //Copy all bytes from previous writes in current_entry to the full buffer for the circbuff
-            if (dev->current_entry.buffptr != NULL){
-                for (i = 0 ; i < dev->current_entry.size; i++){
-                    full_buffer[i] = dev->current_entry.buffptr[i];
+            else{
+                cmd_buffer = aesd_payload_alloc(cmd_end - cmd_start);
+                if (!cmd_buffer){
+                    PDEBUG("Error allocating command buffer!");
+                    break;
                 }
+                memcpy(cmd_buffer, staging + cmd_start, cmd_end - cmd_start);
+                batch[batch_len].buffptr = cmd_buffer;
+                batch[batch_len].size = cmd_end - cmd_start;
+                batch[batch_len].mem_size = cmd_end - cmd_start;
             }
+            cmd_start = cmd_end;
 
-            if (new_write != NULL){
-                for (i = 0; i < len_cmd; i++){
-                    full_buffer[(dev->current_entry.size) + i] = new_write[i];
-                }
+            if (++batch_len == AESD_WRITE_BATCH) {
+                aesd_commit_batch(dev, batch, batch_len);
+                batch_len = 0;
             }
-
-            //Now full_buffer is set up correctly.
-            //can free old buffptr for current entry and newwrite(it should not be present in the circ buff yet and its contents are now in full ptr)
-            kfree(dev->current_entry.buffptr);
-            kfree(new_write);
-
-            dev->current_entry.buffptr = full_buffer;
-            dev->current_entry.size = full_buffer_size;
-
-            //Add entry and if it replaced something in the circular buffer, free the old full buffer value...
-            old_buffer = aesd_circular_buffer_add_entry(&(dev->circ_buff), &(dev->current_entry));
-            if (old_buffer)
-                kfree(old_buffer);
-
-            //if we are writing to buffer, set current_entry buffer to null so that it won't be double freed in module cleanup
-            dev->current_entry.buffptr = NULL;
-            dev->current_entry.size = 0; //reset size to 0 for next write
-            retval = len_cmd; 
-            //can update f_pos here if necessary...
-            *f_pos += len_cmd;
-            PDEBUG("newline command recvd will return %zu", retval);
+        }
+        if (batch_len)
+            aesd_commit_batch(dev, batch, batch_len);
+
+        if (newl_ptr){
+            //Ran out of memory part way through. Report the commands committed so far as a short write
+            //and drop the rest, the caller will write it again.
+            if (cmd_start == 0){
+                retval = -ENOMEM; //nothing committed, partial keeps only the old saved chars
+                goto write_end;
+            }
+            partial->size = 0;
+            retval = cmd_start - old_size;
         }
         else{
-            //simply append new bytes to current entry
-            full_buffer_size = dev->current_entry.size + count;
-            full_buffer = (char *)kmalloc( full_buffer_size, GFP_KERNEL);
-
-            //Copy all bytes from previous writes in current_entry to the full buffer for the circbuff
-            if (dev->current_entry.buffptr != NULL){
-                for (i = 0 ; i < dev->current_entry.size; i++){
-                    full_buffer[i] = dev->current_entry.buffptr[i];
-                }
+            //Keep whatever follows the last newline as the start of the next command
+            if (partial->buffptr){
+                if (cmd_start)
+                    memmove(staging, staging + cmd_start, staged - cmd_start);
+                partial->size = staged - cmd_start;
             }
-
-            if (new_write != NULL){
-                for (i = 0; i < count; i++){
-                    full_buffer[(dev->current_entry.size) + i] = new_write[i];
-                }
+            else{
+                partial->size = 0;
             }
-
-            //Now full_buffer is set up correctly. Can free old buffptr and newwrite as their contents is in full buffer
-            kfree(dev->current_entry.buffptr);
-            kfree(new_write);
-
-            dev->current_entry.buffptr = full_buffer;
-            dev->current_entry.size = full_buffer_size;
             retval = count;
-            //can update f_pos here if necessary...
-            *f_pos += count; 
-            PDEBUG("Non-newline command will return:%zu", retval);
         }
 
+        //can update f_pos here if necessary...
+        *f_pos += retval;
+        PDEBUG("write committed %zu bytes, %zu bytes saved for next command", cmd_start, partial->size);
+
     write_end:
         //unlock lock here...
-        mutex_unlock(&dev->lock);
-        //might want a kfree of new_write here in case failure occurs, do not allow memory leak
+        mutex_unlock(&afile->wlock);
         PDEBUG("write returning with retval=%zu", retval);
         PDEBUG("filepos after write: %lld",*f_pos);
         return retval;
 }
 
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    u64 start_ns = ktime_get_ns();
+    ssize_t retval;
+
+    retval = aesd_do_write(filp, buf, count, f_pos);
+    if (retval > 0)
+        aesd_seal_blocks(dev);
+    aesd_stats_account(dev, AESD_STATS_WRITE, start_ns, retval);
+    return retval;
+}
+
 //New for assignment 9: llseek implementation:
 //Reference: scull character driver main.c scull_llseek 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence){
-    loff_t retval = -EINVAL;
-    uint8_t index; //to iterate over buffer to find size
-    struct aesd_buffer_entry *entry; //to iterate over buffer to find size
     loff_t total_buff_bytes = 0; //to count "size of file" for use with fixed llseek
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_file *afile = filp->private_data;
+    struct aesd_dev *dev = afile->dev;
+    uint64_t base_offs;
+    loff_t retval;
+    unsigned int seq;
 
     PDEBUG("Seeking %lld bytes with whence %d", offset, whence);
     //get the total number of bytes in the circular buffer
-    entry = NULL;
-    //Iterate over all entries and add their value.
-    //NOTE: This only works because we initialize the circular buffer with 0 size in unused elements
-    //      and we don't have a "pop" or "remove" function for our circular buffer. So entries always either
-    //      have a valid size or a 0 size. 
-    AESD_CIRCULAR_BUFFER_FOREACH(entry,&(dev->circ_buff),index) {
-        if (entry != NULL)
-            total_buff_bytes += entry->size;
-    }
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        total_buff_bytes = aesd_total_bytes(dev);
+        base_offs = dev->circ_buff.base_offs;
+    } while (read_seqcount_retry(&dev->seq, seq));
 
     PDEBUG("Total bytes in buffer to seek: %lld", total_buff_bytes);
-    
-    //return if mutex wait interrupted
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
 
     retval = fixed_size_llseek(filp, offset, whence, total_buff_bytes);
-
-    mutex_unlock(&dev->lock);
+    if ((retval >= 0) && afile->follow)
+        afile->follow_offs = base_offs + retval;
     return retval;
 }
 
 //New for assignment 9: ioctl implementation and helper function
 //Reference: scull character driver main.c scull_ioctl
 static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset){
-    struct aesd_dev *dev = filp->private_data;
-    unsigned int num_cmds = 0; //Total number of strings in the circ buffer
-    unsigned int buff_idx = 0; //Location in the circ buffer of target string
-    unsigned int curr_idx = 0; //index used to iterate through circular buffer
-    unsigned int i = 0; 
-    ssize_t total_pos = 0; //the new offset for f_pos
-    struct aesd_buffer_entry target_entry; //Entry in circ buffer containing target string
-    struct aesd_buffer_entry curr_entry; //current entry when iterateing circular buffer
-
-    if (dev->circ_buff.full)
-        num_cmds = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    else
-        //Reference: Howdy Pierce 2022 PES data structures lecture
-        num_cmds = ( (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + dev->circ_buff.in_offs - dev->circ_buff.out_offs) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
-
-    if (write_cmd > (num_cmds -1) ) //-1 because write_cmd is 0 indexed 
-        return -EINVAL;
-    if (write_cmd > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    struct aesd_file *afile = filp->private_data;
+    struct aesd_dev *dev = afile->dev;
+    uint64_t base_offs = 0;
+    struct aesd_buffer_entry *target; //entry in circ buffer containing target string
+    loff_t total_pos = 0; //the new offset for f_pos
+    long retval;
+    unsigned int seq;
+
+    //Compute the new offset from a consistent snapshot of the circular buffer.
+    //Each entry knows where it starts, so this no longer walks the commands before write_cmd.
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        retval = 0;
+        total_pos = 0;
+        base_offs = dev->circ_buff.base_offs;
+
+        //Find the entry in the circular buffer corresponding to the requested cmd (write_cmd is 0 indexed)
+        target = aesd_circular_buffer_entry_at(&(dev->circ_buff), write_cmd);
+        if (target == NULL){
+            retval = -EINVAL;
+            continue;
+        }
+
+        if (write_cmd_offset >= target->size){ //>= becuase write_cmd_offset is 0 indexed
+            retval = -EINVAL;
+            continue;
+        }
+
+        total_pos = aesd_circular_buffer_entry_fpos(&(dev->circ_buff), target) + write_cmd_offset;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    if (retval)
+        return retval;
+
+    PDEBUG("%u is a legal command index", write_cmd);
+
+    filp->f_pos = total_pos;
+    if (afile->follow)
+        afile->follow_offs = base_offs + total_pos;
+
+    return 0;
+
+}
+
+
+//AESDCHAR_IOCSEEKTIME: two binary searches over the entry timestamps, in one seqcount read section
+static long aesd_seek_time(struct file *filp, struct aesd_seektime __user *useek)
+{
+    struct aesd_file *afile = filp->private_data;
+    struct aesd_dev *dev = afile->dev;
+    struct aesd_seektime req;
+    struct aesd_buffer_entry *entry;
+    uint64_t base_offs;
+    uint32_t end_cmd;
+    unsigned int seq;
+
+    if (copy_from_user(&req, useek, sizeof(req)))
+        return -EFAULT;
+    if (req.until && (req.until <= req.since))
         return -EINVAL;
 
-    PDEBUG("%u commands found in buffer. %u is a legal command index", num_cmds, write_cmd);
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        base_offs = dev->circ_buff.base_offs;
+        req.first_cmd = aesd_circular_buffer_find_index_for_time(&(dev->circ_buff), req.since);
+        end_cmd = req.until ? aesd_circular_buffer_find_index_for_time(&(dev->circ_buff), req.until) :
+                aesd_circular_buffer_count(&(dev->circ_buff));
+        entry = aesd_circular_buffer_entry_at(&(dev->circ_buff), req.first_cmd);
+        req.offset = entry ? aesd_circular_buffer_entry_fpos(&(dev->circ_buff), entry) : dev->circ_buff.total_size;
+        entry = aesd_circular_buffer_entry_at(&(dev->circ_buff), end_cmd);
+        req.bytes = (entry ? aesd_circular_buffer_entry_fpos(&(dev->circ_buff), entry) : dev->circ_buff.total_size) -
+                req.offset;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    req.num_cmds = end_cmd - req.first_cmd;
+    if (copy_to_user(useek, &req, sizeof(req)))
+        return -EFAULT;
+
+    filp->f_pos = req.offset;
+    if (afile->follow)
+        afile->follow_offs = base_offs + req.offset;
 
-    //Find the index in the circular buffer corresponding to the requested cmd
-    buff_idx = ( (dev->circ_buff.out_offs + write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ); 
-    target_entry = dev->circ_buff.entry[buff_idx];
+    return 0;
+}
 
-    if (write_cmd_offset >= target_entry.size) //>= becuase write_cmd_offset is 0 indexed
+//AESDCHAR_IOCGETINFO: totals plus a table of the requested commands, walked in batches without dev->lock.
+//Each batch is copied out before the next one is taken, so nothing is sized by the device capacity.
+static long aesd_get_info(struct file *filp, struct aesd_info __user *uinfo)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    struct aesd_info info;
+    struct aesd_buffer_entry batch[AESD_READ_BATCH];
+    struct aesd_entry_info table[AESD_READ_BATCH];
+    struct aesd_entry_info __user *dest;
+    struct aesd_walk walk;
+    unsigned int batch_len;
+    unsigned int i;
+
+    if (copy_from_user(&info, uinfo, sizeof(info)))
+        return -EFAULT;
+
+    //The first batch also fixes the totals, even when no table is requested
+    aesd_walk_init(&walk, info.start);
+    dest = u64_to_user_ptr(info.entries_ptr);
+    info.returned = 0;
+    do {
+        batch_len = aesd_walk_batch(dev, &walk, batch,
+                info.entries_ptr ? min_t(uint32_t, info.max_entries - info.returned, AESD_READ_BATCH) : 0);
+        for (i = 0; i < batch_len; i++) {
+            table[i].size = batch[i].size;
+            table[i].offset = batch[i].offset - walk.base_offs;
+            table[i].seq = batch[i].seq;
+            table[i].timestamp = batch[i].timestamp;
+        }
+        if (batch_len && copy_to_user(dest + info.returned, table, batch_len * sizeof(struct aesd_entry_info)))
+            return -EFAULT;
+        info.returned += batch_len;
+    } while (batch_len);
+
+    info.entries = walk.end_seq - walk.first_seq;
+    info.total_bytes = walk.total_size;
+    info.first_seq = walk.first_seq;
+    info.last_seq = walk.end_seq - 1;
+
+    if (copy_to_user(uinfo, &info, sizeof(info)))
+        return -EFAULT;
+    return 0;
+}
+
+//AESDCHAR_IOCREADCMD: the commands are walked in batches without dev->lock (see aesd_walk_batch) and copied out
+//under the srcu read lock, which keeps their buffers alive even if they are evicted during the copy.
+static long aesd_read_commands(struct file *filp, struct aesd_read_cmd __user *ureq)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    struct aesd_read_cmd req;
+    struct aesd_buffer_entry batch[AESD_READ_BATCH];
+    struct aesd_walk walk;
+    struct aesd_plain *plain;
+    const char *data;
+    char __user *dest;
+    unsigned int batch_len;
+    unsigned int i;
+    uint64_t bytes = 0;
+    bool full = false;
+    long retval = 0;
+    int srcu_idx;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    if (req.num_cmds == 0)
         return -EINVAL;
 
-    //Iterate through all valid commands (besides target one) to get total offset
-    curr_idx = dev->circ_buff.out_offs;
-    for (i = 0; i < write_cmd; i++){ 
-        curr_entry = dev->circ_buff.entry[curr_idx];
-        total_pos += curr_entry.size; 
-        curr_idx = ( (curr_idx + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    dest = u64_to_user_ptr(req.buf_ptr);
+    req.copied_cmds = 0;
+    aesd_walk_init(&walk, req.first_cmd);
+    srcu_idx = srcu_read_lock(&dev->srcu);
+
+    batch_len = aesd_walk_batch(dev, &walk, batch, min_t(uint32_t, req.num_cmds, AESD_READ_BATCH));
+    if (batch_len == 0) {
+        retval = -EINVAL;
+        goto read_unlock;
+    }
+    req.first_seq = batch[0].seq;
+    if (batch[0].size > req.buf_len) {
+        //The first command is larger than the caller's buffer, tell them how large it is
+        bytes = batch[0].size;
+        retval = -ENOSPC;
+        goto read_unlock;
     }
 
-    total_pos += write_cmd_offset; //finally add in the offset within the target command
+    //Whole commands only, as many as fit
+    while (batch_len && !full) {
+        for (i = 0; i < batch_len; i++) {
+            if (bytes + batch[i].size > req.buf_len) {
+                full = true;
+                break;
+            }
+            data = aesd_compress_get_plain(&dev->compress, &batch[i], &plain);
+            if (IS_ERR(data)) {
+                retval = PTR_ERR(data);
+                goto read_unlock;
+            }
+            if (copy_to_user(dest + bytes, data, batch[i].size))
+                retval = -EFAULT;
+            aesd_compress_put_plain(plain);
+            if (retval)
+                goto read_unlock;
+            bytes += batch[i].size;
+            req.copied_cmds++;
+        }
+        if (!full)
+            batch_len = aesd_walk_batch(dev, &walk, batch,
+                    min_t(uint32_t, req.num_cmds - req.copied_cmds, AESD_READ_BATCH));
+    }
 
-    //return if mutex wait interrupted
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+read_unlock:
+    srcu_read_unlock(&dev->srcu, srcu_idx);
 
-    filp->f_pos = total_pos;
+    if (retval && (retval != -ENOSPC))
+        return retval;
 
-    mutex_unlock(&dev->lock);
+    req.bytes = bytes;
+    if (copy_to_user(ureq, &req, sizeof(req)))
+        return -EFAULT;
+    return retval;
+}
 
-    return 0;
+//Boyer-Moore-Horspool state for AESDCHAR_IOCSEARCH. Kept off the stack, the skip table alone is 512 bytes.
+struct aesd_searcher {
+    u16 skip[256];
+    u32 len;
+    u8 pattern[AESD_SEARCH_MAX_PATTERN];
+};
+
+static void aesd_searcher_prepare(struct aesd_searcher *s)
+{
+    u32 i;
 
+    for (i = 0; i < ARRAY_SIZE(s->skip); i++)
+        s->skip[i] = s->len;
+    for (i = 0; i + 1 < s->len; i++)
+        s->skip[s->pattern[i]] = s->len - 1 - i;
 }
 
+//@return the position of the first occurrence of the pattern in data, or -1
+static ssize_t aesd_searcher_find(const struct aesd_searcher *s, const u8 *data, size_t size)
+{
+    const u8 last = s->pattern[s->len - 1];
+    const u8 *found;
+    size_t pos = 0;
 
-long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+    if (s->len == 1) {
+        found = memchr(data, last, size);
+        return found ? found - data : -1;
+    }
+
+    while (size - pos >= s->len) {
+        if ((data[pos + s->len - 1] == last) && !memcmp(data + pos, s->pattern, s->len - 1))
+            return pos;
+        pos += s->skip[data[pos + s->len - 1]];
+    }
+    return -1;
+}
+
+//AESDCHAR_IOCSEARCH: like AESDCHAR_IOCREADCMD, the commands are walked in batches without dev->lock and scanned
+//under the srcu read lock, so writers are never stalled by a long scan and nothing is sized by the device capacity.
+static long aesd_search(struct file *filp, struct aesd_search __user *ureq)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    struct aesd_search req;
+    struct aesd_searcher *searcher;
+    struct aesd_buffer_entry batch[AESD_READ_BATCH];
+    struct aesd_search_match match;
+    struct aesd_search_match __user *dest;
+    struct aesd_walk walk;
+    struct aesd_plain *plain;
+    const char *data;
+    unsigned int batch_len;
+    unsigned int i;
+    uint32_t max_cmds;
+    ssize_t found;
+    long retval = 0;
+    int srcu_idx;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    if ((req.pattern_len == 0) || (req.pattern_len > AESD_SEARCH_MAX_PATTERN) || (req.max_matches == 0))
+        return -EINVAL;
+
+    searcher = kmalloc(sizeof(*searcher), GFP_KERNEL);
+    if (!searcher)
+        return -ENOMEM;
+    searcher->len = req.pattern_len;
+    if (copy_from_user(searcher->pattern, u64_to_user_ptr(req.pattern_ptr), req.pattern_len)) {
+        retval = -EFAULT;
+        goto search_free;
+    }
+    aesd_searcher_prepare(searcher);
+
+    max_cmds = req.max_cmds ? req.max_cmds : U32_MAX;
+    dest = u64_to_user_ptr(req.matches_ptr);
+    req.returned = 0;
+    req.scanned = 0;
+    aesd_walk_init(&walk, req.start);
+    srcu_idx = srcu_read_lock(&dev->srcu);
+
+    do {
+        batch_len = aesd_walk_batch(dev, &walk, batch, min_t(uint32_t, max_cmds - req.scanned, AESD_READ_BATCH));
+        for (i = 0; (i < batch_len) && (req.returned < req.max_matches); i++) {
+            data = aesd_compress_get_plain(&dev->compress, &batch[i], &plain);
+            if (IS_ERR(data)) {
+                retval = PTR_ERR(data);
+                goto search_unlock;
+            }
+            found = aesd_searcher_find(searcher, (const u8 *)data, batch[i].size);
+            aesd_compress_put_plain(plain);
+            if (found >= 0) {
+                match.cmd = aesd_walk_index(&walk, &batch[i]);
+                match.cmd_offset = found;
+                match.offset = batch[i].offset - walk.base_offs + found;
+                match.seq = batch[i].seq;
+                if (copy_to_user(dest + req.returned, &match, sizeof(match))) {
+                    retval = -EFAULT;
+                    goto search_unlock;
+                }
+                req.returned++;
+            }
+            req.scanned++;
+        }
+        if (fatal_signal_pending(current)) {
+            retval = -EINTR;
+            goto search_unlock;
+        }
+        cond_resched();
+    } while (batch_len && (req.returned < req.max_matches));
+
+search_unlock:
+    srcu_read_unlock(&dev->srcu, srcu_idx);
+
+    if (!retval && copy_to_user(ureq, &req, sizeof(req)))
+        retval = -EFAULT;
+
+search_free:
+    kfree(searcher);
+    return retval;
+}
+
+static long aesd_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
     long retval = 0; 
     
 
@@ -361,6 +1469,36 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
 
             break;
         }
+        case AESDCHAR_IOCFOLLOW:
+        {
+            struct aesd_file *afile = filp->private_data;
+            uint32_t follow;
+            unsigned int seq;
+            if (copy_from_user(&follow, (const void __user *)arg, sizeof(follow)) != 0)
+                return -EFAULT;
+
+            //Start following from the current file position
+            if (follow && !afile->follow){
+                do {
+                    seq = read_seqcount_begin(&afile->dev->seq);
+                    afile->follow_offs = afile->dev->circ_buff.base_offs + filp->f_pos;
+                } while (read_seqcount_retry(&afile->dev->seq, seq));
+            }
+            afile->follow = (follow != 0);
+            break;
+        }
+        case AESDCHAR_IOCGETINFO:
+            retval = aesd_get_info(filp, (struct aesd_info __user *)arg);
+            break;
+        case AESDCHAR_IOCREADCMD:
+            retval = aesd_read_commands(filp, (struct aesd_read_cmd __user *)arg);
+            break;
+        case AESDCHAR_IOCSEEKTIME:
+            retval = aesd_seek_time(filp, (struct aesd_seektime __user *)arg);
+            break;
+        case AESDCHAR_IOCSEARCH:
+            retval = aesd_search(filp, (struct aesd_search __user *)arg);
+            break;
         default:
             return -ENOTTY;
     }
@@ -368,21 +1506,118 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
     return retval;
 }
 
+long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    u64 start_ns = ktime_get_ns();
+    long retval;
+
+    retval = aesd_do_ioctl(filp, cmd, arg);
+    aesd_stats_account(dev, AESD_STATS_IOCTL, start_ns, 0);
+    return retval;
+}
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    static const char * const op_names[AESD_STATS_OPS] = { "read", "write", "ioctl" };
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats sum;
+    struct aesd_stats *stats;
+    unsigned int seq;
+    uint32_t entries;
+    size_t history_bytes;
+    size_t history_mem;
+    int cpu, op, bucket;
+
+    memset(&sum, 0, sizeof(sum));
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(dev->stats, cpu);
+        for (op = 0; op < AESD_STATS_OPS; op++) {
+            sum.ops[op] += stats->ops[op];
+            sum.bytes[op] += stats->bytes[op];
+            for (bucket = 0; bucket < AESD_HIST_BUCKETS; bucket++)
+                sum.latency[op][bucket] += stats->latency[op][bucket];
+        }
+        sum.commits += stats->commits;
+        sum.evictions += stats->evictions;
+        sum.shrink_evictions += stats->shrink_evictions;
+        sum.lock_wait_ns += stats->lock_wait_ns;
+    }
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        entries = aesd_circular_buffer_count(&(dev->circ_buff));
+        history_bytes = dev->circ_buff.total_size;
+        history_mem = dev->circ_buff.total_mem;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    seq_printf(s, "reads %llu\nwrites %llu\nioctls %llu\n", sum.ops[AESD_STATS_READ], sum.ops[AESD_STATS_WRITE],
+            sum.ops[AESD_STATS_IOCTL]);
+    seq_printf(s, "bytes_read %llu\nbytes_written %llu\n", sum.bytes[AESD_STATS_READ], sum.bytes[AESD_STATS_WRITE]);
+    seq_printf(s, "commits %llu\nevictions %llu\nshrink_evictions %llu\n", sum.commits, sum.evictions,
+            sum.shrink_evictions);
+    seq_printf(s, "entries %u\nhistory_bytes %zu\nhistory_mem_bytes %zu\norphan_bytes %zu\n", entries, history_bytes,
+            history_mem, READ_ONCE(dev->orphan.size));
+    seq_printf(s, "lock_wait_ns %llu\n", sum.lock_wait_ns);
+    if (dev->compress.enabled) {
+        seq_printf(s, "compressed_blocks %lu\ncompressed_bytes_in %lu\ncompressed_bytes_out %lu\n",
+                READ_ONCE(dev->compress.blocks), READ_ONCE(dev->compress.bytes_in), READ_ONCE(dev->compress.bytes_out));
+        seq_printf(s, "plain_cache_hits %lu\nplain_cache_misses %lu\n", READ_ONCE(dev->compress.hits),
+                READ_ONCE(dev->compress.misses));
+    }
+
+    //Only the buckets which counted something, as "latency_<op> <upper bound in ns> <count>"
+    for (op = 0; op < AESD_STATS_OPS; op++)
+        for (bucket = 0; bucket < AESD_HIST_BUCKETS; bucket++)
+            if (sum.latency[op][bucket])
+                seq_printf(s, "latency_%s %llu %llu\n", op_names[op], 1ULL << bucket, sum.latency[op][bucket]);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
 
 
+
+//Read only shared mapping of the history, see struct aesd_mmap_header in aesd_ioctl.h for the layout
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+
+    if (!dev->mirror.area)
+        return -ENODEV;
+
+    //The view is only ever written by the driver
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    //remap_vmalloc_range refuses mappings which extend past the end of the area
+    return remap_vmalloc_range(vma, dev->mirror.area, vma->vm_pgoff);
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .llseek =   aesd_llseek,
     .read =     aesd_read,
+    .read_iter = aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .write =    aesd_write,
     .unlocked_ioctl = aesd_ioctl, //might want compat_ioctl to work on 32b and 64b
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
     .open =     aesd_open,
     .release =  aesd_release,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -396,66 +1631,187 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
 
 
 
+//Sets up one device: its circular buffer sized from the module parameters, locks, mmap view and cdev
+static int aesd_dev_init(struct aesd_dev *dev, int index)
+{
+    int result;
+
+    //Size the circular buffer from the module parameters
+    dev->stats = alloc_percpu(struct aesd_stats);
+    if (!dev->stats)
+        return -ENOMEM;
+
+    dev->entries = kvcalloc(max_entries, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    if (!dev->entries) {
+        free_percpu(dev->stats);
+        return -ENOMEM;
+    }
+    aesd_circular_buffer_init_capacity(&dev->circ_buff, dev->entries, max_entries);
+
+    //initialize the lock
+    mutex_init(&dev->lock);
+    init_waitqueue_head(&dev->readq);
+    aesd_commit_ring_init(&dev->ring);
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+    result = init_srcu_struct(&dev->srcu);
+    if (result)
+        goto fail_entries;
+
+    result = aesd_mirror_init(dev);
+    if (result)
+        goto fail_srcu;
+
+    result = aesd_compress_init(&dev->compress, compress);
+    if (result)
+        goto fail_mirror;
+
+    result = aesd_shrinker_register(dev, index);
+    if (result)
+        goto fail_compress;
+
+    result = aesd_setup_cdev(dev, index);
+    if (result)
+        goto fail_shrinker;
+
+    return 0;
+
+    //Reference: scull main.c, undo the steps above in reverse order
+  fail_shrinker:
+    aesd_shrinker_unregister(dev);
+  fail_compress:
+    aesd_compress_free(&dev->compress);
+  fail_mirror:
+    aesd_mirror_free(dev);
+  fail_srcu:
+    cleanup_srcu_struct(&dev->srcu);
+  fail_entries:
+    kvfree(dev->entries);
+    mutex_destroy(&dev->lock);
+    free_percpu(dev->stats);
+    return result;
+}
+
+//Removes one device set up by aesd_dev_init and frees everything it holds
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
+
+    cdev_del(&dev->cdev);
+    aesd_shrinker_unregister(dev);
+
+    //Wait for evicted buffers still waiting on a grace period to be freed
+    srcu_barrier(&dev->srcu);
+
+    //Free any dynamically allocated complete writes in device circular buffer
+    AESD_CIRCULAR_BUFFER_FOREACH(entry,&(dev->circ_buff),index) {
+        aesd_payload_free(entry->buffptr);
+    }
+
+    //Free the partial command left by closed files, if any
+    aesd_payload_free(dev->orphan.buffptr);
+    kvfree(dev->entries);
+    aesd_mirror_free(dev);
+    aesd_compress_free(&dev->compress);
+
+    cleanup_srcu_struct(&dev->srcu);
+
+    //deinitialize lock
+    mutex_destroy(&dev->lock);
+    free_percpu(dev->stats);
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    unsigned int i;
+
+    if ((num_devices == 0) || (num_devices > AESD_MAX_DEVICES)) {
+        printk(KERN_WARNING "aesdchar: num_devices must be between 1 and %u\n", AESD_MAX_DEVICES);
+        return -EINVAL;
+    }
+    if (compress && !AESD_HAVE_LZ4) {
+        printk(KERN_WARNING "aesdchar: compress needs a kernel built with CONFIG_LZ4_COMPRESS and CONFIG_LZ4_DECOMPRESS\n");
+        return -EINVAL;
+    }
+    if ((max_entries == 0) || (max_entries > AESD_MAX_ENTRIES_LIMIT)) {
+        printk(KERN_WARNING "aesdchar: max_entries must be between 1 and %u\n", AESD_MAX_ENTRIES_LIMIT);
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, num_devices,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    /**
-     * TODO: initialize the AESD specific portion of the device
-     */
-    
-    //These three steps are actually all done via the memset above which zero's out entire device struct....
-    //aesd_circular_buffer_init(aesd_device.circ_buff); //maybe unnecessary
-    //aesd_device.current_entry.buffptr = (const char *)(0);
-    //aesd_device.current_entry.size = 0;
+    result = aesd_payload_init();
+    if (result)
+        goto fail_region;
 
-    //initialize the lock
-    mutex_init(&aesd_device.lock);
+    result = aesd_compress_module_init(compress);
+    if (result)
+        goto fail_payload;
+
+    //Zeroed, so every circular buffer and orphan starts out empty
+    aesd_devices = kcalloc(num_devices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto fail_compress;
+    }
+
+    for (i = 0; i < num_devices; i++) {
+        result = aesd_dev_init(&aesd_devices[i], i);
+        if (result)
+            goto fail_devices;
+    }
 
-    result = aesd_setup_cdev(&aesd_device);
+    //debugfs is optional, nothing to do if it isn't available
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+    aesd_payload_debugfs_init(aesd_debugfs_root);
+    for (i = 0; i < num_devices; i++) {
+        char name[16];
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+        snprintf(name, sizeof(name), "aesdchar%u", i);
+        debugfs_create_file("stats", S_IRUGO, debugfs_create_dir(name, aesd_debugfs_root), &aesd_devices[i],
+                &aesd_stats_fops);
     }
+
+    return 0;
+
+  fail_devices:
+    while (i--)
+        aesd_dev_cleanup(&aesd_devices[i]);
+    kfree(aesd_devices);
+  fail_compress:
+    aesd_compress_module_exit();
+  fail_payload:
+    aesd_payload_exit();
+  fail_region:
+    unregister_chrdev_region(dev, num_devices);
     return result;
 
 }
 
 void aesd_cleanup_module(void)
 {
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
-
+    unsigned int i;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
-    cdev_del(&aesd_device.cdev);
+    debugfs_remove_recursive(aesd_debugfs_root);
 
-    /**
-     * TODO: cleanup AESD specific poritions here as necessary
-     */
+    for (i = 0; i < num_devices; i++)
+        aesd_dev_cleanup(&aesd_devices[i]);
+    kfree(aesd_devices);
 
-    //Free any dynamically allocated complete writes in device circular buffer
-    AESD_CIRCULAR_BUFFER_FOREACH(entry,&(aesd_device.circ_buff),index) {
-        kfree(entry->buffptr);
-    }
-
-    // //Free any dynamically allocated partial write in current entry
-    //WARNING: Introduced a double free bug in the simple case. Need to be more clever about this.
-    kfree(aesd_device.current_entry.buffptr);
-
-    //deinitialize lock
-    mutex_destroy(&aesd_device.lock);
+    aesd_compress_module_exit();
+    //Every payload is freed now
+    aesd_payload_exit();
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, num_devices);
 }
 
 
@@ -5,9 +5,11 @@
 * Purpose: Open a socket for receiving data and outputing to a file.
 * 
 */
+#define _GNU_SOURCE //splice()
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -20,25 +22,34 @@
 #include <netdb.h>
 #include <signal.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "freebsdqueue.h"
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
 
 #define MAX_TIMESTR_SIZE 100
-#define USE_AESD_CHAR_DEVICE (1)
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE (1) //can be overridden at build time with -DUSE_AESD_CHAR_DEVICE=0
+#endif
 #define AESD_COMMAND_STR "AESDCHAR_IOCSEEKTO:"
 #define AESD_COMMAND_SIZE (19)
 
-//#define RECVBUFF_SIZE 100 //this will be the size per block of recv buffer, if it fills up new block of this size will be added on
-//Note: Current implementation instead recv's byte at a time to simplify recv logic
+#define RECVBUFF_SIZE (64*1024) //initial size of the recv buffer block, doubled whenever a single packet outgrows it
+#define REPLY_CHUNK_SIZE (64*1024) //max bytes moved per sendfile/splice call, and size of the fallback bounce buffer
+#define REACTOR_MAX_EVENTS (64) //max epoll events handled per epoll_wait call in reactor mode
+#define REACTOR_MAX_PACKETS (16) //max packets stored per connection in one reactor round, so pipelining clients take turns
+#define DEFAULT_POOL_SIZE (16) //pool workers, i.e. max connections served at once outside of reactor mode
+#define DEFAULT_QUEUE_DEPTH (64) //accepted connections allowed to wait for a pool worker
 
 //-------------------------------------Globals-------------------------------------
 //Reference for signal handler strategy with flag: https://www.jmoisio.eu/en/blog/2020/04/20/handling-signals-correctly-in-a-linux-application/
-static volatile sig_atomic_t signal_flag = 0; //this flag will be set if sigterm or sigint are received
-#if USE_AESD_CHAR_DEVICE == 0
-pthread_mutex_t pdfile_lock; //mutex for aesdsocketdata file (packet data file) protection
-#endif
-int g_datafd; //global file descriptor to allow timestamp interval timer to access data file
+//Atomic rather than volatile sig_atomic_t so threads can order other accesses against it (see poolWorkerWork)
+static atomic_int signal_flag = 0; //this flag will be set if sigterm or sigint are received
 
 //-------------------------------------Signal Handlers-------------------------------------
 void handle_sigint_sigterm(int sigval){
@@ -47,8 +58,138 @@ void handle_sigint_sigterm(int sigval){
 }
 
 #if USE_AESD_CHAR_DEVICE == 0
-//time stamp alarm handler (handle sigalrm)
-void ts_alarm_handler(int signo){
+//-------------------------Data File Store-----------------------------------------
+//Append log on top of the data file which lets connections append and reply concurrently.
+//An appender reserves a byte range with an atomic add on reserved_end, then writes its own packet buffer
+//into that range with pwrite() in parallel with everyone else. Ranges are published strictly in reservation
+//order by advancing committed_end, so committed_end always marks a complete prefix of the file.
+//Readers snapshot committed_end once and send up to it without holding any lock, bytes before it never change.
+//An appender whose predecessors are done publishes with a compare-exchange and no lock. Only one which finds an
+//earlier range still being written parks, on its own condition variable, and is woken by the appender it follows.
+//A failed write stops the store: its range would be a hole, so neither it nor anything after it is ever published.
+struct publishWaiter_s{
+    unsigned long long start;   //committed_end the waiter is waiting for
+    pthread_cond_t cond;
+    LIST_ENTRY(publishWaiter_s) waiterEntries;
+};
+
+struct dataStore_s{
+    int fd;
+    atomic_ullong reserved_end;  //end of the last byte range handed out to an appender
+    atomic_ullong committed_end; //every byte before this offset has been written
+    atomic_ullong failed_start;  //start of the first range whose write failed, ULLONG_MAX while none did
+    atomic_int num_waiters;      //parked appenders, publishers only take publish_lock when there are some
+    pthread_mutex_t publish_lock; //protects waiters, and orders parking against failed_start
+    LIST_HEAD(publishWaiterHead_s, publishWaiter_s) waiters;
+};
+
+static struct dataStore_s g_datastore;
+
+//Returns 0 on success, -1 if the file could not be opened
+static int data_store_init(struct dataStore_s *store, const char *path){
+    //No O_APPEND: pwrite() ignores its offset on files opened for append
+    store->fd = open(path, (O_RDWR | O_CREAT), 0644);
+    if (store->fd == -1)
+        return -1;
+
+    //Keep anything already in the file
+    struct stat file_stat;
+    if (fstat(store->fd, &file_stat) == -1){
+        close(store->fd);
+        return -1;
+    }
+    atomic_init(&store->reserved_end, file_stat.st_size);
+    atomic_init(&store->committed_end, file_stat.st_size);
+    atomic_init(&store->failed_start, ULLONG_MAX);
+    atomic_init(&store->num_waiters, 0);
+    pthread_mutex_init(&store->publish_lock, NULL);
+    LIST_INIT(&store->waiters);
+    return 0;
+}
+
+//Wakes the parked appender whose range starts at end, or every parked appender if wake_all (after a failure).
+//The seq_cst loads pair with the parking appender, which counts itself before checking committed_end/failed_start.
+static void data_store_wake(struct dataStore_s *store, unsigned long long end, int wake_all){
+    if (atomic_load(&store->num_waiters) == 0)
+        return;
+
+    pthread_mutex_lock(&store->publish_lock);
+    struct publishWaiter_s *waiter;
+    LIST_FOREACH(waiter, &store->waiters, waiterEntries){
+        if (wake_all || (waiter->start == end))
+            pthread_cond_signal(&waiter->cond);
+    }
+    pthread_mutex_unlock(&store->publish_lock);
+}
+
+//Appends len bytes of buff to the store. Returns 0 on success, -1 on write error (now or by an earlier appender)
+static int data_store_append(struct dataStore_s *store, const char *buff, size_t len){
+    if (atomic_load(&store->failed_start) != ULLONG_MAX)
+        return -1;
+
+    unsigned long long start = atomic_fetch_add(&store->reserved_end, len);
+    size_t total_written = 0;
+    int rc = 0;
+
+    while (total_written != len){
+        ssize_t bytes_written = pwrite(store->fd, buff + total_written, len - total_written, start + total_written);
+        if (bytes_written == -1){
+            if (errno == EINTR)
+                continue;
+            syslog((LOG_USER | LOG_INFO),"Error writing packet to file, no longer storing packets");
+            rc = -1;
+            break;
+        }
+        total_written += bytes_written;
+    }
+
+    if (rc == -1){
+        //Nothing from our range on can be published, so the appenders parked after us give up
+        pthread_mutex_lock(&store->publish_lock);
+        if (start < atomic_load(&store->failed_start))
+            atomic_store(&store->failed_start, start);
+        pthread_mutex_unlock(&store->publish_lock);
+        data_store_wake(store, 0, 1);
+        return -1;
+    }
+
+    unsigned long long expected = start;
+    if (!atomic_compare_exchange_strong(&store->committed_end, &expected, start + len)){
+        //An appender which reserved before us may still be in pwrite(), sleep until it has published
+        struct publishWaiter_s waiter = { .start = start };
+        pthread_cond_init(&waiter.cond, NULL);
+        pthread_mutex_lock(&store->publish_lock);
+        LIST_INSERT_HEAD(&store->waiters, &waiter, waiterEntries);
+        atomic_fetch_add(&store->num_waiters, 1);
+        while ((atomic_load(&store->committed_end) != start) && (atomic_load(&store->failed_start) > start))
+            pthread_cond_wait(&waiter.cond, &store->publish_lock);
+        atomic_fetch_sub(&store->num_waiters, 1);
+        LIST_REMOVE(&waiter, waiterEntries);
+        pthread_mutex_unlock(&store->publish_lock);
+        pthread_cond_destroy(&waiter.cond);
+
+        if (atomic_load(&store->committed_end) != start)
+            return -1;
+        //Nobody else publishes from start, it is ours now
+        atomic_store(&store->committed_end, start + len);
+    }
+
+    data_store_wake(store, start + len, 0);
+    return 0;
+}
+
+//Returns the end of the consistent prefix of the store, i.e. how much of it a reply should send
+static off_t data_store_end(struct dataStore_s *store){
+    return (off_t)atomic_load_explicit(&store->committed_end, memory_order_acquire);
+}
+
+//-------------------------Timestamp Thread----------------------------------------
+//Appends an RFC 2822 timestamp to the data file every 10 seconds. This used to be done from a SIGALRM handler,
+//but the append waits on other appenders and must not run in a handler which may have interrupted one of them.
+static pthread_mutex_t ts_lock = PTHREAD_MUTEX_INITIALIZER; //only used to sleep and wake the timestamp thread
+static pthread_cond_t  ts_cond;
+
+static void write_timestamp(void){
     time_t time_now;
     time_t ret = time(&time_now);
     if(ret == -1){
@@ -69,60 +210,45 @@ void ts_alarm_handler(int signo){
         return;
     }
 
-    ssize_t bytes_written = 0;
-    while (bytes_written != time_str_size){
-        
-        #if USE_AESD_CHAR_DEVICE == 0
-        pthread_mutex_lock(&pdfile_lock);
-        #endif
-        bytes_written = write(g_datafd, time_buff,(time_str_size-bytes_written));
-        #if USE_AESD_CHAR_DEVICE == 0
-        pthread_mutex_unlock(&pdfile_lock);
-        #endif
-        
-        if (bytes_written == -1){
-            syslog((LOG_USER | LOG_INFO),"Error writing timestamp!");
-            return;
-        }
-    }
+    if (data_store_append(&g_datastore, time_buff, time_str_size) == -1)
+        syslog((LOG_USER | LOG_INFO),"Error writing timestamp!");
+}
 
+void *timestampThreadWork(void *unused){
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
 
-    return;
-}
-#endif
+    pthread_mutex_lock(&ts_lock);
+    while (!signal_flag){
+        deadline.tv_sec += 10;
+        while (!signal_flag && (pthread_cond_timedwait(&ts_cond, &ts_lock, &deadline) != ETIMEDOUT))
+            ;
+        if (signal_flag)
+            break;
 
+        pthread_mutex_unlock(&ts_lock);
+        write_timestamp();
+        pthread_mutex_lock(&ts_lock);
+    }
+    pthread_mutex_unlock(&ts_lock);
 
-//-------------------------Thread Organization and Functions----------------------
-struct threadParams_s{
-    pthread_t thread;    
-    int packetdata_fd;
-    int connection_fd;
-    char client_ip_str[INET6_ADDRSTRLEN];
-    int thread_complete;
-    SLIST_ENTRY(threadParams_s) qEntries;
-};
+    pthread_exit(NULL);
+}
+#endif
 
-typedef struct threadParams_s threadParams_t; 
 
-struct threadParams_s* getThreadParams(struct sockaddr_storage client_addr, int pd_fd, int c_fd){
-    struct threadParams_s *newP = malloc(sizeof(struct threadParams_s));
-    
-    const char* client_ip_res = inet_ntop(AF_INET6,&(((struct sockaddr_in6*)((struct sockaddr *)&client_addr))->sin6_addr) ,newP->client_ip_str,sizeof(newP->client_ip_str)); //reference: https://stackoverflow.com/questions/12810587/extracting-ip-address-and-port-info-from-sockaddr-storage
-             
-             
+//-------------------------Connection Helpers-------------------------------------
+//Extracts the client address of an accepted connection into ip_str (INET6_ADDRSTRLEN bytes)
+static void get_client_ip_str(struct sockaddr_storage *client_addr, char *ip_str){
+    //reference: https://stackoverflow.com/questions/12810587/extracting-ip-address-and-port-info-from-sockaddr-storage
+    const char* client_ip_res = inet_ntop(AF_INET6,&(((struct sockaddr_in6*)client_addr)->sin6_addr),ip_str,INET6_ADDRSTRLEN);
     if (client_ip_res == NULL){
         syslog((LOG_USER | LOG_INFO),"Errror extracting IP from client address");
-        return NULL;
+        strcpy(ip_str, "unknown");
     }
     else{
         syslog((LOG_USER | LOG_INFO),"Accepted connection from %s",client_ip_res);
-        newP->thread_complete = 0; 
-        newP->packetdata_fd = pd_fd;
-        newP->connection_fd = c_fd;
     }
-    
-    return newP;
-
 }
 
 //----------------------New to A9: Handle Write Commands--------------------------
@@ -133,7 +259,7 @@ struct threadParams_s* getThreadParams(struct sockaddr_storage client_addr, int
 //Returns:
 //          -> 0 if error or command not matching expected format
 //          -> 1 if command matches expected format
-
+#if USE_AESD_CHAR_DEVICE == 1
 static int parse_aesd_write(char * com, ssize_t com_len, struct aesd_seekto* seekto_vals){
     
     if (com_len < AESD_COMMAND_SIZE)
@@ -181,207 +307,1050 @@ static int parse_aesd_write(char * com, ssize_t com_len, struct aesd_seekto* see
 
     return 1;
 }
+#endif
+
+//-------------------------Buffered Receive Engine--------------------------------
+//Receives from a socket in large blocks rather than a byte at a time. Packets are returned as
+//pointers into the block (no copy), and any bytes received after a newline are kept for the next packet.
+struct recv_engine_s{
+    char   *buff;     //block of received bytes
+    size_t capacity;  //number of bytes allocated to buff
+    size_t start;     //offset of the first byte not yet handed out as part of a packet
+    size_t end;       //offset one past the last received byte
+    size_t scanned;   //offset up to which buff has already been searched for a newline
+};
+
+static int recv_engine_init(struct recv_engine_s *eng){
+    eng->buff = (char*)malloc(RECVBUFF_SIZE);
+    if (eng->buff == NULL)
+        return -1;
+
+    eng->capacity = RECVBUFF_SIZE;
+    eng->start    = 0;
+    eng->end      = 0;
+    eng->scanned  = 0;
+    return 0;
+}
+
+static void recv_engine_free(struct recv_engine_s *eng){
+    free(eng->buff);
+    eng->buff = NULL;
+    eng->capacity = 0;
+}
+
+//Makes room at the end of the block for another recv.
+//Leftover bytes are only moved to the front when the block is full, and the block is only grown
+//when a single partial packet fills all of it.
+//Returns 0 on success, -1 if the block could not be grown
+static int recv_engine_make_room(struct recv_engine_s *eng){
+    if (eng->start == eng->end){
+        //Everything has been consumed, reuse the block from the beginning
+        eng->start   = 0;
+        eng->end     = 0;
+        eng->scanned = 0;
+        return 0;
+    }
+
+    if (eng->end < eng->capacity)
+        return 0;
+
+    if (eng->start > 0){
+        //Slide the partial packet to the front of the block
+        memmove(eng->buff, eng->buff + eng->start, eng->end - eng->start);
+        eng->end     -= eng->start;
+        eng->scanned -= eng->start;
+        eng->start    = 0;
+        return 0;
+    }
+
+    char *new_buff = realloc(eng->buff, eng->capacity*2);
+    if (new_buff == NULL)
+        return -1;
+
+    eng->buff      = new_buff;
+    eng->capacity *= 2;
+    return 0;
+}
+
+//Finds the next newline terminated packet on fd.
+//packet:   set to the start of the packet within the engine block. Only valid until the next call.
+//Returns:
+//          -> length of the packet including its newline
+//          -> 0 if the connection was closed (any unterminated partial packet is discarded)
+//          -> -1 on error or when interrupted by a signal (errno is left set by recv)
+static ssize_t recv_engine_next_packet(struct recv_engine_s *eng, int fd, char **packet){
+    while (1){
+        //memchr is vectorized by libc, so only bytes which have not been searched yet are scanned
+        char *newl_ptr = memchr(eng->buff + eng->scanned, '\n', eng->end - eng->scanned);
+        if (newl_ptr != NULL){
+            size_t packet_end = (size_t)(newl_ptr - eng->buff) + 1;
+            ssize_t packet_len = (ssize_t)(packet_end - eng->start);
+
+            *packet = eng->buff + eng->start;
+            eng->start   = packet_end;
+            eng->scanned = packet_end;
+            return packet_len;
+        }
+        eng->scanned = eng->end;
+
+        if (recv_engine_make_room(eng) == -1){
+            syslog((LOG_USER | LOG_INFO),"Error current packet received is larger than heap size!");
+            errno = ENOMEM;
+            return -1;
+        }
+
+        ssize_t recv_bytes = recv(fd, eng->buff + eng->end, eng->capacity - eng->end, 0);
+        if (recv_bytes == 0)
+            return 0;
+        if (recv_bytes == -1){
+            if ((errno == EINTR) && !signal_flag)
+                continue; //interrupted by a signal we don't terminate on (e.g. timestamp alarm)
+            return -1;
+        }
+
+        eng->end += recv_bytes;
+    }
+}
 
 //-------------------------Reading and Writing Functionality----------------------
-//Note, assumes that fd is open and connection_fd is connected
-int write_file_to_socket(int fd, int connection_fd){
-    //TODO: might want to add EINTR error check in case seek is interrupted by signal
-    #if USE_AESD_CHAR_DEVICE == 0
-    off_t old_pos = lseek(fd,0,SEEK_CUR);
-    lseek(fd, 0 , SEEK_CUR);
+#if USE_AESD_CHAR_DEVICE == 1
+//Writes a complete packet to the char device.
+//A single write call is used where possible so the char driver receives the whole command at once.
+static int write_packet_to_file(int fd, const char *packet, size_t packet_len){
+    size_t total_written = 0;
 
-    if (old_pos == (off_t)-1){
-         syslog((LOG_USER | LOG_INFO),"Error in old seek");
-         return -1;
+    while (total_written != packet_len){
+        ssize_t bytes_written = write(fd, packet + total_written, packet_len - total_written);
+        if (bytes_written == -1){
+            if (errno == EINTR)
+                continue;
+            syslog((LOG_USER | LOG_INFO),"Error writing packet to file");
+            return -1;
+        }
+        total_written += bytes_written;
     }
 
+    return 0;
+}
+#endif
 
-    lseek(fd, 0, SEEK_SET);
-    syslog((LOG_USER | LOG_INFO),"Setting pos to 0");
+#if USE_AESD_CHAR_DEVICE == 0
+//Sends the data file from the start up to end with sendfile(). Since an explicit offset is used the file position is untouched.
+static int sendfile_to_socket(int fd, int connection_fd, off_t end){
+    off_t offset = 0;
+    while (offset < end){
+        size_t to_send = end - offset;
+        if (to_send > REPLY_CHUNK_SIZE)
+            to_send = REPLY_CHUNK_SIZE;
 
-    //now read from the start of the file
-    off_t new_pos = lseek(fd,0,SEEK_SET);
-    if (new_pos == (off_t)(-1)) {
-         syslog((LOG_USER | LOG_INFO),"Error in new seek");
-         return -1;
-    }    
-    #endif
-    
+        ssize_t bytes_sent = sendfile(connection_fd, fd, &offset, to_send);
+        if (bytes_sent == -1){
+            if (errno == EINTR){
+                if (signal_flag)
+                    syslog((LOG_USER | LOG_INFO),"sendfile interrupted by signal, finishing file operations then begin clean termination...");
+                continue;
+            }
+            syslog((LOG_USER | LOG_INFO),"Error in sendfile");
+            return -1;
+        }
+        if (bytes_sent == 0)
+            break; //file was truncated underneath us
+    }
 
-    //write character by character from file to socket. likely inefficient, but easy to wrap my head around
-    char read_buff[1];
+    return 0;
+}
+#else
+//Sends len bytes of buff to the socket, retrying on partial sends and signal interruption
+static int send_all(int connection_fd, const char *buff, size_t len){
+    size_t total_sent = 0;
+
+    while (total_sent != len){
+        ssize_t bytes_sent = send(connection_fd, buff + total_sent, len - total_sent, 0);
+        if (bytes_sent == -1){
+            if (errno == EINTR){
+                if (signal_flag)
+                    syslog((LOG_USER | LOG_INFO),"socket_write interrupted by signal, finishing file operations then begin clean termination...");
+                continue; //we were interrupted by signal handler, retry send as per https://beej.us/guide/bgnet/pdf pg.77
+            }
+            syslog((LOG_USER | LOG_INFO),"Error in socket write");
+            return -1;
+        }
+        total_sent += bytes_sent;
+    }
+
+    return 0;
+}
+
+//Fallback reply path: read from the current file position to EOF through a large bounce buffer
+static int bounce_file_to_socket(int fd, int connection_fd){
+    char *bounce_buff = malloc(REPLY_CHUNK_SIZE);
+    if (bounce_buff == NULL){
+        syslog((LOG_USER | LOG_INFO),"Error allocating reply bounce buffer");
+        return -1;
+    }
+
+    int rc = 0;
     ssize_t bytes_read;
-    int bytes_sent;
-    
-    while((bytes_read = read(fd,read_buff,1)) != 0){
+    while((bytes_read = read(fd, bounce_buff, REPLY_CHUNK_SIZE)) != 0){
         if (bytes_read == -1){
-            if ((errno == EINTR) && signal_flag) {
-                 syslog((LOG_USER | LOG_INFO),"file read interrupted by signal, finishing file operations then begin clean termination...");
-             }
-             else{
-                 syslog((LOG_USER | LOG_INFO),"Error in file read");
-                 return -1;
-             }    
+            if (errno == EINTR){
+                if (signal_flag)
+                    syslog((LOG_USER | LOG_INFO),"file read interrupted by signal, finishing file operations then begin clean termination...");
+                continue;
+            }
+            syslog((LOG_USER | LOG_INFO),"Error in file read");
+            rc = -1;
+            break;
         }
-        else{
-            //successfully read byte
-            retry_send:
-            bytes_sent = send(connection_fd,read_buff,1,0);
-            if (bytes_sent != 1){
-                if ((errno == EINTR) && signal_flag) {
-                     syslog((LOG_USER | LOG_INFO),"socket_write interrupted by signal, finishing file operations then begin clean termination...");
-                     goto retry_send; //we were interrupted by signal handler, retry send as per https://beej.us/guide/bgnet/pdf pg.77
-                 }
-                 else{
-                     syslog((LOG_USER | LOG_INFO),"Error in socket write");
-                     return -1;
-                 }                
+
+        if (send_all(connection_fd, bounce_buff, bytes_read) == -1){
+            rc = -1;
+            break;
+        }
+    }
+
+    free(bounce_buff);
+    return rc;
+}
+
+//Moves the char device contents from the current file position to the socket through a pipe with splice(),
+//so the data never passes through user space. pipe_fds is the connection's reply pipe, created on first use
+//(both -1 until then) and kept until the connection is closed. It is left empty on success.
+//Returns 0 on success, -1 on error, or 1 if the device doesn't support splice and nothing was sent
+static int splice_file_to_socket(int fd, int connection_fd, int pipe_fds[2]){
+    if ((pipe_fds[0] == -1) && (pipe(pipe_fds) == -1)){
+        syslog((LOG_USER | LOG_INFO),"Error creating reply pipe");
+        pipe_fds[0] = pipe_fds[1] = -1;
+        return -1;
+    }
+
+    int rc = 0;
+    int first_splice = 1;
+    while (1){
+        ssize_t bytes_in = splice(fd, NULL, pipe_fds[1], NULL, REPLY_CHUNK_SIZE, SPLICE_F_MOVE);
+        if (bytes_in == 0)
+            break;
+        if (bytes_in == -1){
+            if (errno == EINTR){
+                if (signal_flag)
+                    syslog((LOG_USER | LOG_INFO),"file read interrupted by signal, finishing file operations then begin clean termination...");
+                continue;
+            }
+            if (first_splice && (errno == EINVAL))
+                rc = 1; //driver has no splice_read, let caller fall back to read/send
+            else{
+                syslog((LOG_USER | LOG_INFO),"Error splicing file to pipe");
+                rc = -1;
             }
+            break;
         }
+        first_splice = 0;
+
+        //drain everything that was put in the pipe into the socket. No SPLICE_F_MORE: it would cork the
+        //tail of the reply, and the kernel already sets MSG_MORE itself while the pipe holds more data
+        while (bytes_in > 0){
+            ssize_t bytes_out = splice(pipe_fds[0], NULL, connection_fd, NULL, bytes_in, SPLICE_F_MOVE);
+            if (bytes_out == -1){
+                if (errno == EINTR){
+                    if (signal_flag)
+                        syslog((LOG_USER | LOG_INFO),"socket_write interrupted by signal, finishing file operations then begin clean termination...");
+                    continue;
+                }
+                syslog((LOG_USER | LOG_INFO),"Error splicing pipe to socket");
+                rc = -1;
+                break;
+            }
+            bytes_in -= bytes_out;
+        }
+        if (rc == -1)
+            break;
     }
-    
-    //return the file position to where it was...
-    #if USE_AESD_CHAR_DEVICE == 0
-    if (old_pos == (off_t)-1){
-         syslog((LOG_USER | LOG_INFO),"Error in resetting seek");
-         return -1;
+
+    return rc;
+}
+#endif
+
+#if USE_AESD_CHAR_DEVICE == 1
+//Stores a received packet in the char device, or applies it if it is a seekto command
+//Returns an open device fd positioned where the reply should start, or -1 on error
+static int aesdchar_handle_packet(char *packet, ssize_t packet_len){
+    struct aesd_seekto seekto;
+    int packetdata_fd = open("/dev/aesdchar", (O_RDWR  | O_APPEND));
+    if (packetdata_fd == -1){
+        syslog((LOG_USER | LOG_INFO),"Error opening /dev/aesdchar");
+        return -1;
     }
-    #endif
 
-    return 0;    
+    if (parse_aesd_write(packet, packet_len, &seekto)){
+        //We have received a valid command string. Don't write into device,
+        //the reply is read from the same fd the seek was applied to (don't close and reopen after seek or fpos lost)
+        if (ioctl(packetdata_fd, AESDCHAR_IOCSEEKTO, &seekto)){
+            syslog((LOG_USER | LOG_INFO),"ERROR IN IOCTL\r\n");
+            close(packetdata_fd);
+            return -1;
+        }
+        return packetdata_fd;
+    }
+
+    //the write moves our file position, read back from the start of the device
+    if ((write_packet_to_file(packetdata_fd, packet, packet_len) == -1) ||
+        (lseek(packetdata_fd, 0, SEEK_SET) == (off_t)-1)){
+        close(packetdata_fd);
+        return -1;
+    }
+
+    return packetdata_fd;
 }
+#endif
 
-void *connectionThreadWork(void *threadParamsIn){
+//Note, assumes that fd is open and connection_fd is connected
+//Data file: the entire file is sent. Char device: sent from the current file position (set by seekto) to the end,
+//through the connection's reply pipe (see splice_file_to_socket, unused for the data file).
+int write_file_to_socket(int fd, int connection_fd, int reply_pipe[2]){
+    #if USE_AESD_CHAR_DEVICE == 0
+    //the end of the store is sampled once so the reply is a snapshot of the file at request time
+    return sendfile_to_socket(fd, connection_fd, data_store_end(&g_datastore));
+    #else
+    int rc = splice_file_to_socket(fd, connection_fd, reply_pipe);
+    if (rc == 1)
+        rc = bounce_file_to_socket(fd, connection_fd);
+    return rc;
+    #endif
+}
 
-     threadParams_t *threadParams = (threadParams_t *)threadParamsIn;
-     
-     char* recv_buff = (char*)malloc(1*sizeof(char));
-     if (recv_buff == NULL){
+//Receives packets from a connection and replies to each of them until the connection is closed,
+//a signal is received or an error occurs. The caller closes connection_fd.
+static void serve_connection(int connection_fd){
+     struct recv_engine_s recv_eng;
+     if (recv_engine_init(&recv_eng) == -1){
          syslog((LOG_USER | LOG_INFO),"Error when allocating initial recv buffer block!");
-         threadParams->thread_complete = 1;
-         pthread_exit(NULL);
+         return;
      }
-     
-     int recv_buff_size    = 1;  //will track how much mem is allocated to buffer of received characters
-     int recv_block_bytes  = 0;  //will track the number of bytes read each iteration of the loop (should be 0 or 1)
-     int newline_recv      = 0;  //acting as a boolean for whether or not the newest character was a newline
-     int connection_closed = 0;  //acting as a bollean for whether or not connection has closed
-     
 
-     while (!connection_closed && !signal_flag){
-         //Receive bytes from connection, one byte at a time until newline
-         newline_recv = 0;
-         while((!newline_recv) && (!connection_closed) && (!signal_flag)){
-             recv_block_bytes = recv(threadParams->connection_fd,recv_buff+recv_buff_size-1,1,0);
-             if (recv_block_bytes == 0){
-                 syslog((LOG_USER | LOG_INFO),"Connection closed");
-                 recv_buff_size--; 
-                 connection_closed = 1;
-             }
-             else if (recv_block_bytes == -1){
-                 if (signal_flag) {
-                     syslog((LOG_USER | LOG_INFO),"recv interrupted by signal, begin clean termination...\r\n");
-                 }
-                 else{
-                     syslog((LOG_USER | LOG_INFO),"Error in socket recv");
-                     threadParams->thread_complete = 1;
-                     pthread_exit(NULL);
-                 }
-                     
-             }
-             else{
-                 //Check if new byte is a newline
-                 if (recv_buff[recv_buff_size - 1] == '\n'){
-                     newline_recv = 1;
-                 }
-                 //If can't assume command string has a newline, must process seek command detection here
-                 else{
-                     //add new byte to buffer to be read in at the next loop execution
-                     recv_buff_size ++;
-                     recv_buff = realloc(recv_buff, (recv_buff_size)*sizeof(char)); //allocate
-                     if (recv_buff == NULL){
-                         syslog((LOG_USER | LOG_INFO),"Error current packet received is larger than heap size!\r\n");
-                         threadParams->thread_complete = 1;
-                         pthread_exit(NULL);
-                     }
-                 }
-             }
+     char *packet;       //start of the newest packet within the recv engine block
+     ssize_t packet_len; //length of the newest packet including its newline
+     int reply_pipe[2] = { -1, -1 }; //created by the first char device reply, reused by the ones after it
+
+     while (!signal_flag){
+         //Receive the next newline terminated packet
+         packet_len = recv_engine_next_packet(&recv_eng, connection_fd, &packet);
+         if (packet_len == 0){
+             syslog((LOG_USER | LOG_INFO),"Connection closed");
+             break;
+         }
+         else if (packet_len == -1){
+             if (signal_flag)
+                 syslog((LOG_USER | LOG_INFO),"recv interrupted by signal, begin clean termination...\r\n");
+             else
+                 syslog((LOG_USER | LOG_INFO),"Error in socket recv");
+             break;
          }
-             
-         if (newline_recv){
-             //if we've reached here, its time to write to file, newline recvd
-
-            //Variables for tracking ioctl command
-            struct aesd_seekto seekto;
-            int    ioctl_packetdata_fd; //fd to use when ioctl command recvd (don't close and reopen after seek or fpos lost)
-            int    seekcom_recv = 0; //bool of if valid seekto ioctl comm recvd or not
-
-            //If not using our char device, never attempt to execute ioctl etc.
-            #if USE_AESD_CHAR_DEVICE == 0
-                seekcom_recv = 0;
-            #else
-                seekcom_recv = parse_aesd_write(recv_buff, recv_buff_size, &seekto); //should put correct offsets in seekto
-            #endif
-
-            if (seekcom_recv){
-                //We have received a valid command string
-                ioctl_packetdata_fd = open("/dev/aesdchar", (O_RDWR  | O_APPEND));
-                int ioctl_ret = ioctl(ioctl_packetdata_fd, AESDCHAR_IOCSEEKTO, &seekto);
-                if (ioctl_ret){
-                    syslog((LOG_USER | LOG_INFO),"ERROR IN IOCTL, killing thread...\r\n");
-                    threadParams->thread_complete = 1;
-                    pthread_exit(NULL);
-                }
-                //don't write into device. 
-                //write the file to the connection with same fd as ioctl above
-            }
 
-            //We can reset our recieve buffer to a single char in preparation for recieving next packet
-            recv_buff_size = 1;
-            recv_buff = realloc(recv_buff, (recv_buff_size)*sizeof(char)); //allocate
-            if (recv_buff == NULL){
-                syslog((LOG_USER | LOG_INFO),"Error resetting recv buffer size!");
-                threadParams->thread_complete = 1;
-                pthread_exit(NULL);
-            }
-                 
-            //write the file to the connection
-            //Note: might want more granular locking within the function, but since file pos will be moved throughout, it might be best to lock entire function.
-            #if USE_AESD_CHAR_DEVICE == 0
-                pthread_mutex_lock(&pdfile_lock);
-            #else
-                //if seekcom was received, we already have an open fd to use for reading and writing file out to socket
-                if (!seekcom_recv)
-                    threadParams->packetdata_fd = open("/dev/aesdchar", (O_RDWR  | O_APPEND));
-                else
-                    threadParams->packetdata_fd = ioctl_packetdata_fd; 
-            #endif
-            int f2sRes = write_file_to_socket(threadParams->packetdata_fd, threadParams->connection_fd);
-            #if USE_AESD_CHAR_DEVICE == 0
-                pthread_mutex_unlock(&pdfile_lock);
-            #else
-                close(threadParams->packetdata_fd);
-            #endif
-
-            if (f2sRes == -1){
-                syslog((LOG_USER | LOG_INFO),"Error writting file to socket!");
-                threadParams->thread_complete = 1;
-                pthread_exit(NULL);
+         //if we've reached here, its time to write to file, newline recvd
+        //write the packet to the file, then the file to the connection
+        int f2sRes = 0;
+        #if USE_AESD_CHAR_DEVICE == 0
+            //No lock needed, the store orders appends itself and the reply only sends the committed prefix
+            f2sRes = data_store_append(&g_datastore, packet, packet_len);
+            if (f2sRes == 0)
+                f2sRes = write_file_to_socket(g_datastore.fd, connection_fd, reply_pipe);
+        #else
+            int reply_fd = aesdchar_handle_packet(packet, packet_len);
+            if (reply_fd == -1)
+                f2sRes = -1;
+            else{
+                f2sRes = write_file_to_socket(reply_fd, connection_fd, reply_pipe);
+                close(reply_fd);
             }
+        #endif
+
+        if (f2sRes == -1){
+            syslog((LOG_USER | LOG_INFO),"Error writting file to socket!");
+            break;
         }
     }
     
     //If we reach here, either the connection was closed or sigint or sigterm were recvd
-    close(threadParams->connection_fd); //might wanna check return value
-    syslog((LOG_USER | LOG_INFO),"Closed connection from %s",threadParams->client_ip_str);
+    if (reply_pipe[0] != -1){
+        close(reply_pipe[0]);
+        close(reply_pipe[1]);
+    }
+    recv_engine_free(&recv_eng);
+}
+
+//-------------------------Worker Pool--------------------------------------------
+//A fixed number of workers are started up front. The acceptor hands connected sockets to them through
+//a bounded lock-free multi-producer/multi-consumer ring (Vyukov's sequence numbered cell queue), and
+//workers with nothing to do park on a condition variable instead of spinning.
+//Reference: https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+struct handoffCell_s{
+    atomic_size_t sequence; //tells producers/consumers whose turn it is to use the cell
+    int connection_fd;
+    char client_ip_str[INET6_ADDRSTRLEN];
+};
+
+struct handoffRing_s{
+    struct handoffCell_s *cells;
+    size_t mask;            //number of cells - 1 (number of cells is a power of two)
+    atomic_size_t enqueue_pos;
+    atomic_size_t dequeue_pos;
+};
+
+struct poolWorker_s{
+    pthread_t thread;
+    struct workerPool_s *pool;
+    pthread_mutex_t active_lock; //held to change active_fd, and by the acceptor while it shuts active_fd down
+    int active_fd;          //connection currently being served, -1 if idle
+};
+
+struct workerPool_s{
+    struct handoffRing_s ring;
+    struct poolWorker_s *workers;
+    int num_workers;
+    pthread_mutex_t park_lock;  //only used to park/wake threads, never held while the ring is used
+    pthread_cond_t  work_cond;  //signalled when a connection is queued and a worker is parked
+    pthread_cond_t  space_cond; //signalled when a cell is freed and the acceptor is parked (block mode)
+    atomic_int parked_workers;
+    atomic_int acceptor_parked;
+};
+
+static int handoff_ring_init(struct handoffRing_s *ring, size_t depth){
+    size_t num_cells = 2;
+    while (num_cells < depth)
+        num_cells <<= 1;
+
+    ring->cells = calloc(num_cells, sizeof(struct handoffCell_s));
+    if (ring->cells == NULL)
+        return -1;
+
+    for (size_t i = 0; i < num_cells; i++)
+        atomic_init(&ring->cells[i].sequence, i);
+    ring->mask = num_cells - 1;
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    return 0;
+}
+
+//Returns 0 if the connection was queued, -1 if the ring is full
+static int handoff_ring_push(struct handoffRing_s *ring, int connection_fd, const char *client_ip_str){
+    struct handoffCell_s *cell;
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+
+    while (1){
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0){
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0){
+            return -1; //the cell a full lap behind us hasn't been consumed yet
+        }
+        else{
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->connection_fd = connection_fd;
+    strcpy(cell->client_ip_str, client_ip_str);
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+//Returns 0 and fills connection_fd/client_ip_str if a connection was dequeued, -1 if the ring is empty
+static int handoff_ring_pop(struct handoffRing_s *ring, int *connection_fd, char *client_ip_str){
+    struct handoffCell_s *cell;
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+
+    while (1){
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0){
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0){
+            return -1; //nothing has been published in this cell yet
+        }
+        else{
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *connection_fd = cell->connection_fd;
+    strcpy(client_ip_str, cell->client_ip_str);
+    atomic_store_explicit(&cell->sequence, pos + ring->mask + 1, memory_order_release);
+    return 0;
+}
+
+//Wakes a parked thread if the other side has announced it is parking.
+//The seq_cst fence pairs with the increment of *parked before the parked thread re-checks the ring,
+//so either we see it parked or it sees the ring change.
+static void pool_wake_parked(struct workerPool_s *pool, atomic_int *parked, pthread_cond_t *cond){
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(parked) > 0){
+        pthread_mutex_lock(&pool->park_lock);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&pool->park_lock);
+    }
+}
+
+void *poolWorkerWork(void *workerIn){
+    struct poolWorker_s *worker = (struct poolWorker_s *)workerIn;
+    struct workerPool_s *pool = worker->pool;
+    int connection_fd;
+    char client_ip_str[INET6_ADDRSTRLEN];
+
+    while (!signal_flag){
+        if (handoff_ring_pop(&pool->ring, &connection_fd, client_ip_str) == -1){
+            //Nothing queued: announce we are parking, then check once more before sleeping
+            pthread_mutex_lock(&pool->park_lock);
+            atomic_fetch_add(&pool->parked_workers, 1);
+            int got_work = (handoff_ring_pop(&pool->ring, &connection_fd, client_ip_str) == 0);
+            if (!got_work && !signal_flag)
+                pthread_cond_wait(&pool->work_cond, &pool->park_lock);
+            atomic_fetch_sub(&pool->parked_workers, 1);
+            pthread_mutex_unlock(&pool->park_lock);
+            if (!got_work)
+                continue;
+        }
+
+        //A cell was freed, let a blocked acceptor continue
+        pool_wake_parked(pool, &pool->acceptor_parked, &pool->space_cond);
+
+        //Publish the connection before checking for termination, so the acceptor's shutdown pass either finds
+        //it or the check below sees signal_flag. It is cleared before close, so the pass never hits a reused fd.
+        pthread_mutex_lock(&worker->active_lock);
+        int stopping = signal_flag;
+        if (!stopping)
+            worker->active_fd = connection_fd;
+        pthread_mutex_unlock(&worker->active_lock);
+
+        if (!stopping)
+            serve_connection(connection_fd);
+
+        pthread_mutex_lock(&worker->active_lock);
+        worker->active_fd = -1;
+        pthread_mutex_unlock(&worker->active_lock);
+        close(connection_fd); //might wanna check return value
+        syslog((LOG_USER | LOG_INFO),"Closed connection from %s",client_ip_str);
+    }
 
-    free(recv_buff);
-    
-    threadParams->thread_complete = 1;     
     pthread_exit(NULL);
 }
 
+//Accepts connections and queues them for num_workers pre-spawned workers until a signal is received.
+//When queue_depth connections are already waiting, the acceptor either waits for a free cell (block_when_full)
+//or closes the new connection right away.
+//Returns 0 on clean termination, -1 on error
+static int run_pool_mode(int socket_fd, int num_workers, int queue_depth, int block_when_full){
+    struct workerPool_s pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.park_lock, NULL);
+    pthread_cond_init(&pool.work_cond, NULL);
+    pthread_cond_init(&pool.space_cond, NULL);
+    atomic_init(&pool.parked_workers, 0);
+    atomic_init(&pool.acceptor_parked, 0);
+
+    pool.workers = calloc(num_workers, sizeof(struct poolWorker_s));
+    if ((pool.workers == NULL) || (handoff_ring_init(&pool.ring, queue_depth) == -1)){
+        syslog((LOG_USER | LOG_INFO),"Error allocating worker pool");
+        free(pool.workers);
+        return -1;
+    }
+
+    int rc = 0;
+    for (; pool.num_workers < num_workers; pool.num_workers++){
+        struct poolWorker_s *worker = &pool.workers[pool.num_workers];
+        worker->pool = &pool;
+        worker->active_fd = -1;
+        pthread_mutex_init(&worker->active_lock, NULL);
+        if (pthread_create(&worker->thread, NULL, poolWorkerWork, worker)){
+            syslog((LOG_USER | LOG_INFO),"Errror starting pool worker %d", pool.num_workers);
+            pthread_mutex_destroy(&worker->active_lock);
+            rc = -1;
+            break;
+        }
+    }
+    syslog((LOG_USER | LOG_INFO),"Started %d pool workers, queue depth %zu", pool.num_workers, pool.ring.mask + 1);
+
+    while (!signal_flag && (rc == 0)){ //forever wait for connections
+        //reference: "https://beej.us/guide/bgnet: pg. 28"
+        struct sockaddr_storage client_addr; //address of the remote client connecting. Note that sockaddr_storage can fit ipv6 or v4
+        socklen_t client_addr_size = sizeof(client_addr);
+        char client_ip_str[INET6_ADDRSTRLEN];
+
+        int connection_fd = accept(socket_fd, (struct sockaddr*)&client_addr, &client_addr_size);
+        if(connection_fd == -1){
+            if ((errno == EINTR) && signal_flag) {
+                syslog((LOG_USER | LOG_INFO),"socket accept interrupted by signal, begin clean termination...\r\n");
+            }
+            else if ((errno == EINTR) || (errno == ECONNABORTED)){
+                continue;
+            }
+            else{
+                syslog((LOG_USER | LOG_INFO),"Error accepting socket connection");
+                rc = -1;
+            }
+            continue;
+        }
+        get_client_ip_str(&client_addr, client_ip_str);
+
+        //successful connection! hand it to a worker
+        int queued = (handoff_ring_push(&pool.ring, connection_fd, client_ip_str) == 0);
+        while (!queued && block_when_full && !signal_flag){
+            //Same parking protocol as the workers, with the roles reversed
+            pthread_mutex_lock(&pool.park_lock);
+            atomic_fetch_add(&pool.acceptor_parked, 1);
+            queued = (handoff_ring_push(&pool.ring, connection_fd, client_ip_str) == 0);
+            if (!queued && !signal_flag)
+                pthread_cond_wait(&pool.space_cond, &pool.park_lock);
+            atomic_fetch_sub(&pool.acceptor_parked, 1);
+            pthread_mutex_unlock(&pool.park_lock);
+        }
+
+        if (!queued){
+            syslog((LOG_USER | LOG_INFO),"Connection queue full, rejecting connection from %s", client_ip_str);
+            close(connection_fd);
+            continue;
+        }
+        pool_wake_parked(&pool, &pool.parked_workers, &pool.work_cond);
+    }
+
+    //Wake parked workers, and shut down the sockets of busy ones so their blocking recv/send return
+    pthread_mutex_lock(&pool.park_lock);
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.park_lock);
+    for (int i = 0; i < pool.num_workers; i++){
+        struct poolWorker_s *worker = &pool.workers[i];
+        pthread_mutex_lock(&worker->active_lock);
+        if (worker->active_fd != -1)
+            shutdown(worker->active_fd, SHUT_RDWR);
+        pthread_mutex_unlock(&worker->active_lock);
+    }
+    for (int i = 0; i < pool.num_workers; i++){
+        syslog((LOG_USER | LOG_INFO),"Killing connection thread");
+        pthread_join(pool.workers[i].thread, NULL); //TODO:might want to check retval rather than NULL
+        pthread_mutex_destroy(&pool.workers[i].active_lock);
+    }
+
+    //Close connections which were accepted but never picked up
+    int connection_fd;
+    char client_ip_str[INET6_ADDRSTRLEN];
+    while (handoff_ring_pop(&pool.ring, &connection_fd, client_ip_str) == 0)
+        close(connection_fd);
+
+    free(pool.ring.cells);
+    free(pool.workers);
+    pthread_cond_destroy(&pool.space_cond);
+    pthread_cond_destroy(&pool.work_cond);
+    pthread_mutex_destroy(&pool.park_lock);
+
+    return rc;
+}
+
+//-------------------------Epoll Reactor Mode (-e)-------------------------------
+//Instead of a thread per connection, connections are spread over a small number of reactor threads.
+//Each reactor waits on its own edge triggered epoll set of non-blocking sockets, and every connection
+//carries a state machine so that partial packets and partially sent replies resume on the next event.
+enum connState_e{
+    CONN_RECEIVING, //waiting for the rest of a packet
+    CONN_REPLYING   //reply in progress, waiting for the socket to become writable
+};
+
+struct reactorConn_s{
+    int connection_fd;
+    char client_ip_str[INET6_ADDRSTRLEN];
+    enum connState_e state;
+    struct recv_engine_s recv_eng;
+    int reply_fd;           //file being sent as the reply (-1 when no reply is in progress)
+    #if USE_AESD_CHAR_DEVICE == 0
+    off_t reply_offset;     //next data file offset to send
+    off_t reply_end;        //data file size when the packet was stored, the reply stops here
+    #else
+    char *reply_buff;       //device bytes read but not yet sent
+    size_t reply_len;       //number of valid bytes in reply_buff
+    size_t reply_sent;      //number of bytes from reply_buff already sent
+    #endif
+    int ready;              //on the reactor ready queue, i.e. packets were left for the next round
+    LIST_ENTRY(reactorConn_s) connEntries;
+    TAILQ_ENTRY(reactorConn_s) readyEntries;
+};
+
+struct reactor_s{
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;            //eventfd used to wake the reactor on termination
+    pthread_mutex_t conns_lock; //protects conns, which the acceptor adds to and the reactor removes from
+    LIST_HEAD(reactorConnHead_s, reactorConn_s) conns;
+    TAILQ_HEAD(reactorReadyHead_s, reactorConn_s) ready; //only used by the reactor thread
+};
+
+static void reactor_conn_close(struct reactor_s *reactor, struct reactorConn_s *conn){
+    pthread_mutex_lock(&reactor->conns_lock);
+    LIST_REMOVE(conn, connEntries);
+    pthread_mutex_unlock(&reactor->conns_lock);
+    if (conn->ready)
+        TAILQ_REMOVE(&reactor->ready, conn, readyEntries);
+
+    close(conn->connection_fd); //also removes the fd from the epoll set
+    syslog((LOG_USER | LOG_INFO),"Closed connection from %s",conn->client_ip_str);
+
+    #if USE_AESD_CHAR_DEVICE == 1
+    if (conn->reply_fd != -1)
+        close(conn->reply_fd);
+    free(conn->reply_buff);
+    #endif
+    recv_engine_free(&conn->recv_eng);
+    free(conn);
+}
+
+//Stores a packet and sets up the reply state for it
+//Returns 0 on success, -1 if the connection should be closed
+static int reactor_conn_start_reply(struct reactorConn_s *conn, char *packet, ssize_t packet_len){
+    #if USE_AESD_CHAR_DEVICE == 0
+    //The bytes before reply_end never change, so the reply can be sent at whatever pace the client reads
+    if (data_store_append(&g_datastore, packet, packet_len) == -1)
+        return -1;
+
+    conn->reply_fd     = g_datastore.fd;
+    conn->reply_offset = 0;
+    conn->reply_end    = data_store_end(&g_datastore);
+    #else
+    conn->reply_fd = aesdchar_handle_packet(packet, packet_len);
+    if (conn->reply_fd == -1)
+        return -1;
+
+    if (conn->reply_buff == NULL){
+        conn->reply_buff = malloc(REPLY_CHUNK_SIZE);
+        if (conn->reply_buff == NULL){
+            syslog((LOG_USER | LOG_INFO),"Error allocating reply buffer");
+            return -1;
+        }
+    }
+    conn->reply_len  = 0;
+    conn->reply_sent = 0;
+    #endif
+
+    conn->state = CONN_REPLYING;
+    return 0;
+}
+
+//Sends as much of the current reply as the socket accepts
+//Returns 0 when the reply is complete, 1 if the socket is full, -1 on error
+static int reactor_conn_continue_reply(struct reactorConn_s *conn){
+    #if USE_AESD_CHAR_DEVICE == 0
+    while (conn->reply_offset < conn->reply_end){
+        size_t to_send = conn->reply_end - conn->reply_offset;
+        if (to_send > REPLY_CHUNK_SIZE)
+            to_send = REPLY_CHUNK_SIZE;
+
+        ssize_t bytes_sent = sendfile(conn->connection_fd, conn->reply_fd, &conn->reply_offset, to_send);
+        if (bytes_sent == -1){
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return 1;
+            syslog((LOG_USER | LOG_INFO),"Error in sendfile");
+            return -1;
+        }
+        if (bytes_sent == 0)
+            break;
+    }
+    conn->reply_fd = -1;
+    #else
+    while (1){
+        if (conn->reply_sent < conn->reply_len){
+            ssize_t bytes_sent = send(conn->connection_fd, conn->reply_buff + conn->reply_sent, conn->reply_len - conn->reply_sent, 0);
+            if (bytes_sent == -1){
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                    return 1;
+                syslog((LOG_USER | LOG_INFO),"Error in socket write");
+                return -1;
+            }
+            conn->reply_sent += bytes_sent;
+            continue;
+        }
+
+        ssize_t bytes_read = read(conn->reply_fd, conn->reply_buff, REPLY_CHUNK_SIZE);
+        if (bytes_read == -1){
+            if (errno == EINTR)
+                continue;
+            syslog((LOG_USER | LOG_INFO),"Error in file read");
+            return -1;
+        }
+        if (bytes_read == 0)
+            break;
+
+        conn->reply_len  = bytes_read;
+        conn->reply_sent = 0;
+    }
+    close(conn->reply_fd);
+    conn->reply_fd = -1;
+    //the reply buffer is only kept while replying so idle connections stay small
+    free(conn->reply_buff);
+    conn->reply_buff = NULL;
+    #endif
+
+    conn->state = CONN_RECEIVING;
+    return 0;
+}
+
+//Runs the connection state machine until it would block or REACTOR_MAX_PACKETS packets were stored
+//Returns 0 if it would block, 1 if packets may be left for the next round, -1 if the connection should be closed
+static int reactor_conn_process(struct reactorConn_s *conn){
+    for (int num_packets = 0; ; num_packets++){
+        if (conn->state == CONN_REPLYING){
+            int rc = reactor_conn_continue_reply(conn);
+            if (rc != 0)
+                return rc == 1 ? 0 : -1;
+        }
+
+        //Edge triggered, so no new event comes for the packets left behind, see reactor_conn_run
+        if (num_packets == REACTOR_MAX_PACKETS)
+            return 1;
+
+        //Packets received while the previous reply was in progress are still in the recv engine block
+        char *packet;
+        ssize_t packet_len = recv_engine_next_packet(&conn->recv_eng, conn->connection_fd, &packet);
+        if (packet_len == 0){
+            syslog((LOG_USER | LOG_INFO),"Connection closed");
+            return -1;
+        }
+        if (packet_len == -1){
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return 0;
+            if (!signal_flag)
+                syslog((LOG_USER | LOG_INFO),"Error in socket recv");
+            return -1;
+        }
+
+        if (reactor_conn_start_reply(conn, packet, packet_len) == -1){
+            syslog((LOG_USER | LOG_INFO),"Error writting file to socket!");
+            return -1;
+        }
+    }
+}
+
+//Processes a connection, queueing it on the ready queue if packets were left or closing it
+static void reactor_conn_run(struct reactor_s *reactor, struct reactorConn_s *conn){
+    int rc = reactor_conn_process(conn);
+    if (rc == -1){
+        reactor_conn_close(reactor, conn);
+    }
+    else if ((rc == 1) && !conn->ready){
+        conn->ready = 1;
+        TAILQ_INSERT_TAIL(&reactor->ready, conn, readyEntries);
+    }
+}
+
+void *reactorThreadWork(void *reactorIn){
+    struct reactor_s *reactor = (struct reactor_s *)reactorIn;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (!signal_flag){
+        //Don't sleep while connections have packets left from the last round
+        int timeout = TAILQ_EMPTY(&reactor->ready) ? -1 : 0;
+        int num_events = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, timeout);
+        if (num_events == -1){
+            if (errno == EINTR)
+                continue;
+            syslog((LOG_USER | LOG_INFO),"Error in epoll_wait");
+            break;
+        }
+
+        //Connections left from the last round get one more turn after the events, those queued now wait for the next
+        struct reactorReadyHead_s turn = TAILQ_HEAD_INITIALIZER(turn);
+        TAILQ_CONCAT(&turn, &reactor->ready, readyEntries);
+
+        for (int i = 0; i < num_events; i++){
+            struct reactorConn_s *conn = (struct reactorConn_s *)events[i].data.ptr;
+            if (conn == NULL)
+                continue; //wake_fd, signal_flag is checked by the loop
+            if (conn->ready)
+                continue; //gets its turn from the ready queue below
+
+            reactor_conn_run(reactor, conn);
+        }
+
+        while (!TAILQ_EMPTY(&turn)){
+            struct reactorConn_s *conn = TAILQ_FIRST(&turn);
+            TAILQ_REMOVE(&turn, conn, readyEntries);
+            conn->ready = 0;
+            reactor_conn_run(reactor, conn);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+//Accepts connections and hands them out round robin to num_reactors reactor threads until a signal is received
+//Returns 0 on clean termination, -1 on error
+static int run_reactor_mode(int socket_fd, int num_reactors){
+    struct reactor_s *reactors = calloc(num_reactors, sizeof(struct reactor_s));
+    if (reactors == NULL){
+        syslog((LOG_USER | LOG_INFO),"Error allocating reactors");
+        return -1;
+    }
+
+    //Every connection is an fd, so allow as many as the hard limit permits
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0){
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    int rc = 0;
+    int num_started = 0;
+    for (; num_started < num_reactors; num_started++){
+        struct reactor_s *reactor = &reactors[num_started];
+        LIST_INIT(&reactor->conns);
+        TAILQ_INIT(&reactor->ready);
+        pthread_mutex_init(&reactor->conns_lock, NULL);
+
+        reactor->epoll_fd = epoll_create1(0);
+        reactor->wake_fd  = eventfd(0, EFD_NONBLOCK);
+        struct epoll_event wake_event = { .events = EPOLLIN, .data.ptr = NULL };
+        if ((reactor->epoll_fd == -1) || (reactor->wake_fd == -1) ||
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &wake_event) ||
+            pthread_create(&reactor->thread, NULL, reactorThreadWork, reactor)){
+            syslog((LOG_USER | LOG_INFO),"Error starting reactor %d", num_started);
+            if (reactor->epoll_fd != -1)
+                close(reactor->epoll_fd);
+            if (reactor->wake_fd != -1)
+                close(reactor->wake_fd);
+            pthread_mutex_destroy(&reactor->conns_lock);
+            rc = -1;
+            break;
+        }
+    }
+    syslog((LOG_USER | LOG_INFO),"Started %d reactors", num_started);
+
+    int next_reactor = 0;
+    while (!signal_flag && (rc == 0)){
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_size = sizeof(client_addr);
+
+        int connection_fd = accept4(socket_fd, (struct sockaddr*)&client_addr, &client_addr_size, SOCK_NONBLOCK);
+        if (connection_fd == -1){
+            if ((errno == EINTR) && signal_flag){
+                syslog((LOG_USER | LOG_INFO),"socket accept interrupted by signal, begin clean termination...\r\n");
+            }
+            else if ((errno == EINTR) || (errno == ECONNABORTED)){
+                continue;
+            }
+            else if ((errno == EMFILE) || (errno == ENFILE)){
+                syslog((LOG_USER | LOG_INFO),"Out of file descriptors, delaying accept");
+                usleep(10000);
+            }
+            else{
+                syslog((LOG_USER | LOG_INFO),"Error accepting socket connection");
+                rc = -1;
+            }
+            continue;
+        }
+
+        struct reactorConn_s *conn = calloc(1, sizeof(struct reactorConn_s));
+        if ((conn == NULL) || (recv_engine_init(&conn->recv_eng) == -1)){
+            syslog((LOG_USER | LOG_INFO),"Error allocating connection state");
+            free(conn);
+            close(connection_fd);
+            continue;
+        }
+        get_client_ip_str(&client_addr, conn->client_ip_str);
+        conn->connection_fd = connection_fd;
+        conn->state         = CONN_RECEIVING;
+        conn->reply_fd      = -1;
+
+        //Add to the list before the epoll set, the reactor may close the connection as soon as it is added
+        struct reactor_s *reactor = &reactors[next_reactor];
+        next_reactor = (next_reactor + 1) % num_reactors;
+        pthread_mutex_lock(&reactor->conns_lock);
+        LIST_INSERT_HEAD(&reactor->conns, conn, connEntries);
+        pthread_mutex_unlock(&reactor->conns_lock);
+
+        struct epoll_event conn_event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, connection_fd, &conn_event)){
+            syslog((LOG_USER | LOG_INFO),"Error adding connection to reactor");
+            reactor_conn_close(reactor, conn);
+        }
+    }
+
+    //Wake every reactor so it sees signal_flag, then close whatever connections are left
+    uint64_t wake_val = 1;
+    for (int i = 0; i < num_started; i++){
+        if (write(reactors[i].wake_fd, &wake_val, sizeof(wake_val)) == -1)
+            syslog((LOG_USER | LOG_INFO),"Error waking reactor %d", i);
+    }
+    for (int i = 0; i < num_started; i++){
+        struct reactor_s *reactor = &reactors[i];
+        pthread_join(reactor->thread, NULL);
+        while (!LIST_EMPTY(&reactor->conns))
+            reactor_conn_close(reactor, LIST_FIRST(&reactor->conns));
+        close(reactor->epoll_fd);
+        close(reactor->wake_fd);
+        pthread_mutex_destroy(&reactor->conns_lock);
+    }
+    free(reactors);
+
+    return rc;
+}
+
 int main(int argc, char*argv[]){
+
+    //Command line options:
+    //  -d      run as a daemon
+    //  -e      use the epoll reactor mode rather than a thread per connection
+    //  -r num  number of reactor threads in reactor mode (default: one per online cpu)
+    //  -p num  number of pool workers when not in reactor mode (default: DEFAULT_POOL_SIZE)
+    //  -q num  max connections waiting for a free pool worker, rounded up to a power of two (default: DEFAULT_QUEUE_DEPTH)
+    //  -b mode what to do with new connections when the queue is full: "block" (default) or "reject"
+    int daemon_mode  = 0;
+    int reactor_mode = 0;
+    int num_reactors = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int pool_size    = DEFAULT_POOL_SIZE;
+    int queue_depth  = DEFAULT_QUEUE_DEPTH;
+    int block_when_full = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "der:p:q:b:")) != -1){
+        switch (opt){
+            case 'd':
+                daemon_mode = 1;
+                break;
+            case 'e':
+                reactor_mode = 1;
+                break;
+            case 'r':
+                num_reactors = atoi(optarg);
+                break;
+            case 'p':
+                pool_size = atoi(optarg);
+                break;
+            case 'q':
+                queue_depth = atoi(optarg);
+                break;
+            case 'b':
+                if (!strcmp(optarg, "block"))
+                    block_when_full = 1;
+                else if (!strcmp(optarg, "reject"))
+                    block_when_full = 0;
+                else
+                    goto usage;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (num_reactors < 1)
+        num_reactors = 1;
+    if (pool_size < 1)
+        pool_size = 1;
+    if (queue_depth < 1)
+        queue_depth = 1;
     
     //reference:https://www.jmoisio.eu/en/blog/2020/04/20/handling-signals-correctly-in-a-linux-application/
     //Add signal handler for sig int and sigterm
@@ -393,6 +1362,8 @@ int main(int argc, char*argv[]){
     sa.sa_flags = 0;
     sigaction(SIGTERM, &sa, NULL);
     sigaction(SIGINT, &sa, NULL);
+    //A client disconnecting mid reply should fail that send (EPIPE), not terminate the server
+    signal(SIGPIPE, SIG_IGN);
    
     
     //References: AESD course slides "Sockets pg. 15: Getting Sockaddr", "https://beej.us/guide/bgnet: pg. 21"
@@ -453,20 +1424,18 @@ int main(int argc, char*argv[]){
      }
      else{
          syslog((LOG_USER | LOG_INFO),"Socket successfully binded!");
-         if (argc > 1){
-             if (!strcmp(argv[1],"-d")){
-                 //we are goin demon mode
-                if ( daemon(0,1) == -1){
-                    syslog((LOG_USER | LOG_INFO),"Error binding socket! No socket binded, exiting program...");
-                    return -1;
-                }
-                
-             }
+         if (daemon_mode){
+             //we are goin demon mode
+            if ( daemon(0,1) == -1){
+                syslog((LOG_USER | LOG_INFO),"Error binding socket! No socket binded, exiting program...");
+                return -1;
+            }
          }
      }
      
      //listen for connections
-     rc = listen(socket_fd, 5); //wait for connection, allow backlog of 5 waiters...
+     //wait for connection, allow backlog of 5 waiters... (reactor mode is meant for many clients, use the system max)
+     rc = listen(socket_fd, reactor_mode ? SOMAXCONN : 5);
      if (rc == -1){
          syslog((LOG_USER | LOG_INFO),"Error listening to socket");
          return -1;
@@ -475,134 +1444,44 @@ int main(int argc, char*argv[]){
      //Open or Create file for input data
      #if USE_AESD_CHAR_DEVICE == 1   
         syslog((LOG_USER | LOG_INFO),"Using char driver rather than data file");
-        //int packetdata_fd = open("/dev/aesdchar", (O_RDWR  | O_APPEND));
+        //each packet opens /dev/aesdchar itself
     #else
         syslog((LOG_USER | LOG_INFO),"Using data file rather than char driver");
-        int packetdata_fd = open("/var/tmp/aesdsocketdata", (O_RDWR | O_CREAT | O_APPEND), 0644);
-    
-     
-     if (packetdata_fd == -1){
+     if (data_store_init(&g_datastore, "/var/tmp/aesdsocketdata") == -1){
          syslog((LOG_USER | LOG_INFO),"Errror creating/opening temp data file");
          return -1;
      }
 
-     g_datafd = packetdata_fd;
-
-    #endif
-    //Initialize mutex for packet data file
-     #if USE_AESD_CHAR_DEVICE == 0
-    pthread_mutex_init(&pdfile_lock,NULL);
-    #endif
-
-
-    //Signal handler for sigalrm and 10 second interval timer setup
-    //Note only register this AFTER datafile has opened.
-    #if USE_AESD_CHAR_DEVICE == 0
-    signal(SIGALRM, ts_alarm_handler);
-
-    struct itimerval ts_delay;
-    ts_delay.it_value.tv_sec        = 10;  //first delay: 
-    ts_delay.it_value.tv_usec       = 0;   //first dalay us
-    ts_delay.it_interval.tv_sec     = 10;  //repeated delay
-    ts_delay.it_interval.tv_usec    = 0;   //repeated delay us
+    //Start the 10 second timestamp thread. Note only start this AFTER datafile has opened.
+    pthread_t ts_thread;
+    pthread_condattr_t ts_cond_attr;
+    pthread_condattr_init(&ts_cond_attr);
+    pthread_condattr_setclock(&ts_cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ts_cond, &ts_cond_attr);
+    pthread_condattr_destroy(&ts_cond_attr);
 
     tzset();
 
-    int ret = setitimer(ITIMER_REAL, &ts_delay, NULL);
-    if (ret){
-        perror("settimer failure");
+    if (pthread_create(&ts_thread, NULL, timestampThreadWork, NULL)){
+        syslog((LOG_USER | LOG_INFO),"Error starting timestamp thread");
         return 1;
     }
     #endif
 
-     //Set up connection LL
-     int num_connections = 0;
-     SLIST_HEAD(slisthead,threadParams_s) head = SLIST_HEAD_INITIALIZER(head);
-     SLIST_INIT(&head);
-     //Used for joining dead threads/iterating over threads
-     threadParams_t *curThread = NULL;
-     threadParams_t *tmpPtr = NULL;
-     
-     while(!signal_flag){ //forever wait for connections
-         //reference: "https://beej.us/guide/bgnet: pg. 28"
-         struct sockaddr_storage client_addr; //address of the remote client connecting. Note that sockaddr_storage can fit ipv6 or v4
-         socklen_t client_addr_size = sizeof(client_addr);
-
-         int connection_fd;
-         //char client_ip_str[INET6_ADDRSTRLEN]; //has been moved into thread parameters as of A6
-
-         
-         connection_fd = accept(socket_fd, (struct sockaddr*)&client_addr, &client_addr_size);
-         if(connection_fd == -1){
-             if ((errno == EINTR) && signal_flag) {
-                 syslog((LOG_USER | LOG_INFO),"socket accept interrupted by signal, begin clean termination...\r\n");
-             }
-             else{
-                 syslog((LOG_USER | LOG_INFO),"Error accepting socket connection");
-                 return -1;
-             }
-         }
-         else{
-             //successful connection!
-            #if USE_AESD_CHAR_DEVICE == 0
-             threadParams_t *newThreadParams = getThreadParams(client_addr,packetdata_fd, connection_fd);
-            #else
-             threadParams_t *newThreadParams = getThreadParams(client_addr,-1, connection_fd);
-            #endif
-             if (newThreadParams == NULL){
-                syslog((LOG_USER | LOG_INFO),"Errror initializing thread parameters");
-                return -1;
-             }
-             
-             if (pthread_create(&(newThreadParams->thread),NULL,connectionThreadWork,(void*)newThreadParams)){
-                 syslog((LOG_USER | LOG_INFO),"Errror initializing thread parameters");
-                 return -1;           
-             }
-
-             
-             //Define head if this is our first connection
-             if (num_connections == 0){
-                 SLIST_INIT(&head);
-                 SLIST_INSERT_HEAD(&head, newThreadParams, qEntries);
-             }
-             //Add thread info to LL
-             else{
-                 SLIST_INSERT_HEAD(&head, newThreadParams, qEntries);
-             }
-             
-             num_connections++;
-             syslog((LOG_USER | LOG_INFO),"Current Number of Connections: %d",num_connections);
-             
-             //Join dead threads           
-             SLIST_FOREACH_SAFE(curThread, &head, qEntries, tmpPtr){
-                 if (curThread->thread_complete){
-                     syslog((LOG_USER | LOG_INFO),"Killing connection thread");
-                     pthread_join(curThread->thread,NULL); //TODO:might want to check retval rather than NULL
-                     SLIST_REMOVE(&head, curThread, threadParams_s, qEntries);
-                     free(curThread);
-                     num_connections --;
-                     syslog((LOG_USER | LOG_INFO),"Current Number of Connections: %d",num_connections);
-                 }
-             }     
-         }
-    }
-    
-    
-   //Wait for threads to finish up 
-   SLIST_FOREACH_SAFE(curThread, &head, qEntries, tmpPtr){
-         syslog((LOG_USER | LOG_INFO),"Killing connection thread");
-         pthread_kill(curThread->thread,SIGINT);
-         pthread_join(curThread->thread,NULL); //TODO:might want to check retval rather than NULL
-         SLIST_REMOVE(&head, curThread, threadParams_s, qEntries);
-         free(curThread);
-         num_connections--;
-         syslog((LOG_USER | LOG_INFO),"Current Number of Connections: %d",num_connections);
-    }
-
+     if (reactor_mode)
+         rc = run_reactor_mode(socket_fd, num_reactors);
+     else
+         rc = run_pool_mode(socket_fd, pool_size, queue_depth, block_when_full);
+     if (rc == -1)
+         return -1;
 
-    
     #if USE_AESD_CHAR_DEVICE == 0
-    close(packetdata_fd);
+    pthread_mutex_lock(&ts_lock);
+    pthread_cond_broadcast(&ts_cond);
+    pthread_mutex_unlock(&ts_lock);
+    pthread_join(ts_thread, NULL);
+
+    close(g_datastore.fd);
     
     //remove the data file
     if (remove ("/var/tmp/aesdsocketdata") !=0 ){
@@ -613,4 +1492,8 @@ int main(int argc, char*argv[]){
     close(socket_fd);
     
     return 0;    
+
+usage:
+    fprintf(stderr, "Usage: %s [-d] [-e [-r num_reactors]] [-p pool_size] [-q queue_depth] [-b block|reject]\n", argv[0]);
+    return -1;
 }    